@@ -0,0 +1,61 @@
+#ifndef BLUR_H
+#define BLUR_H
+
+#include <functional>
+#include <vector>
+
+namespace blur
+{
+  // blurs a width x height plane in place, edge pixels repeat outside the plane like
+  // the Nuke row fetch. the box filter keeps running sums, the Gaussian is the
+  // recursive Young - van Vliet filter matched to the variance of the box, so both
+  // cost the same for any radius. filter is a Constants::BlurFilterType
+  void BlurPlane(float *plane, int width, int height, int filter, float radius);
+
+  // the two passes of BlurPlane apart, so a plane can be shared out in bands: the row
+  // pass over rows [y0, y1), the column pass over columns [x0, x1). every row band is
+  // done before any column band starts
+  void BlurRows(float *plane, int width, int height, int filter, float radius, int y0, int y1);
+  void BlurColumns(float *plane, int width, int height, int filter, float radius, int x0, int x1);
+
+  // pixels the blur of a pixel reads on each side. the recursive Gaussian has no end,
+  // past five sigma its tail moves a pixel by under 1e-4 of the contrast around it
+  int BlurReach(int filter, float radius);
+
+  // true when the blur runs as the box, the Gaussian below half a pixel of sigma does
+  bool BoxFilter(int filter, float radius);
+
+  // the box blur of rows [y0, y1) one row at a time, without a plane of the frame. the
+  // window keeps the column sums of the rows around its row, moving down one row reads
+  // two rows whatever the radius. rows past [y0, y1) repeat the edge rows
+  class BoxWindow
+  {
+   public:
+    // fills row y of [y0, y1) with channels lines of width floats, false on abort
+    typedef std::function<bool(int y, float *row)> RowSource;
+
+    BoxWindow();
+
+    // empties the window for rows of width x channels pixels
+    void Reset(int width, int channels, float radius, int y0, int y1);
+
+    // row the window is at, below y0 when empty
+    int Position() const { return _row; }
+
+    // blurs row y into out, channels lines of width. the window moves down from its
+    // row, or is filled again when y is above it or further than a fill costs
+    bool Blur(int y, const RowSource &source, float *out);
+
+   private:
+    bool Fill(int y, const RowSource &source, float *row);
+
+    int _width, _channels;
+    float _radius;
+    int _y0, _y1;
+    int _row;
+    std::vector<double> _sum;                 // rows row - whole to row + whole
+    std::vector<float> _above, _below, _line;  // outer taps, rows row -/+ (whole + 1)
+  };
+}  // namespace blur
+
+#endif  // BLUR_H
@@ -3,29 +3,27 @@
 
 #include <algorithm>
 #include <cmath>
+#include <cstddef>
 
-#include "DDImage/DDMath.h"
-#include "DDImage/Vector3.h"
-#include "DDImage/Vector4.h"
 #include "include/Constants.h"
+#include "include/FastMath.h"
+#include "include/Vector.h"
 
-namespace nuke = DD::Image;
-
-inline float magnitude(const Vector3 v)
+namespace color
 {
-  return std::sqrt(v.dot(v));
-}
+  inline float magnitude(const Vector3 v)
+  {
+    return std::sqrt(v.dot(v));
+  }
 
-inline float cosAngleBetween(const Vector3 a, const Vector3 b)
-{
-  float magA = magnitude(a);
-  float magB = magnitude(b);
-  if(magA == 0.0f || magB == 0.0f) return 0.0f;
-  return a.dot(b) / (magA * magB);
-}
+  inline float cosAngleBetween(const Vector3 a, const Vector3 b)
+  {
+    float magA = magnitude(a);
+    float magB = magnitude(b);
+    if(magA == 0.0f || magB == 0.0f) return 0.0f;
+    return a.dot(b) / (magA * magB);
+  }
 
-namespace color
-{
   enum ScreenColor {
     kScreenColorRed = 0,
     kScreenColorGreen = 1,
@@ -33,47 +31,68 @@ namespace color
   };
   namespace luma
   {
-    float ToLumaRec709(const float (&rgb)[3])
+    inline float ToLumaRec709(const float (&rgb)[3])
     {
       float l = rgb[0] * 0.2126f + rgb[1] * 0.7152f + rgb[2] * 0.0722f;
       return l;
     }
 
-    float ToLumaCcir601(const float (&rgb)[3])
+    inline float ToLumaCcir601(const float (&rgb)[3])
     {
       float l = rgb[0] * 0.299f + rgb[1] * 0.587f + rgb[2] * 0.114f;
       return l;
     }
 
-    float ToLumaRec2020(const float (&rgb)[3])
+    inline float ToLumaRec2020(const float (&rgb)[3])
     {
       float l = rgb[0] * 0.2627f + rgb[1] * 0.6780f + rgb[2] * 0.0593f;
       return l;
     }
 
-    float ToLumaAverage(const float (&rgb)[3])
+    inline float ToLumaAverage(const float (&rgb)[3])
     {
       float l = (rgb[0] + rgb[1] + rgb[2]) / 3.0f;
       return l;
     }
 
-    float ToLumaMax(const float (&rgb)[3])
+    inline float ToLumaMax(const float (&rgb)[3])
     {
       float l = std::max({rgb[0], rgb[1], rgb[2]});
       return l;
     }
   }  // namespace luma
 
-  Vector3 HueRotate(const Vector3 rgb, const float &angle)
+  // cos and sin of a hue shift in degrees, taken once per shift instead of on every
+  // rotation. a zero shift leaves the rgb untouched
+  struct HueRotation {
+    float cosA;
+    float sinA;
+    bool identity;
+
+    // rotation by the opposite shift
+    HueRotation Inverse() const { return {cosA, -sinA, identity}; }
+  };
+
+  template <typename Tier = fastmath::ExactTier>
+  inline HueRotation MakeHueRotation(float angle)
+  {
+    HueRotation rotation;
+    rotation.cosA = Tier::Cos(angle * fastmath::kPi / 180.0f);
+    rotation.sinA = Tier::Sin(angle * fastmath::kPi / 180.0f);
+    rotation.identity = angle == 0.0f;
+    return rotation;
+  }
+
+  inline Vector3 HueRotate(const Vector3 rgb, const HueRotation &rotation)
   {
     Vector3 hue;
 
-    if(angle == 0.0f) {
+    if(rotation.identity) {
       return rgb;
     }
 
-    float cosA = std::cos(angle * M_PI_F / 180.0f);
-    float sinA = std::sin(angle * M_PI_F / 180.0f);
+    float cosA = rotation.cosA;
+    float sinA = rotation.sinA;
     float sqrt3 = std::sqrt(3.0f);
     float common = (rgb.x + rgb.y + rgb.z) * (1.0f - cosA) / 3.0f;
 
@@ -84,7 +103,7 @@ namespace color
     return hue;
   }
 
-  Vector3 VectorToPlane(const Vector3 v1, const Vector3 v2 = {1.0f, 1.0f, 1.0f})
+  inline Vector3 VectorToPlane(const Vector3 v1, const Vector3 v2 = {1.0f, 1.0f, 1.0f})
   {
     Vector3 proj;
     float scale;
@@ -95,14 +114,15 @@ namespace color
     return v1 - proj;
   }
 
-  float ColorAngle(const Vector3 v1, const Vector3 v2)
+  template <typename Tier = fastmath::ExactTier>
+  inline float ColorAngle(const Vector3 v1, const Vector3 v2)
   {
     Vector3 normal(1.0f, 1.0f, 1.0f);
 
     float mag1 = v1.dot(v1);
     float mag2 = v2.dot(v2);
 
-    float angle = std::acos(v1.dot(v2) / std::sqrt(mag1 * mag2));
+    float angle = Tier::Acos(v1.dot(v2) / std::sqrt(mag1 * mag2));
 
     Vector3 crs = v1.cross(v2);
 
@@ -113,11 +133,18 @@ namespace color
     return angle;
   }
 
-  Vector4 Despill(const Vector3 rgb, float hueShift, int _clr, int despillMath, float limit,
-                  float customWeight, bool protectTones, Vector3 protectColor,
-                  float protectTolerance, float protectEffect, float protectFalloff)
+  // exponent of the protect weight, 1 / tolerance^falloff, constant for a validate
+  inline float ProtectExponent(float protectTolerance, float protectFalloff)
   {
-    Vector3 hueIn = HueRotate(rgb, hueShift);
+    return 1 / std::pow(protectTolerance, protectFalloff);
+  }
+
+  template <typename Tier = fastmath::ExactTier>
+  inline Vector4 Despill(const Vector3 rgb, const HueRotation &rotation, int _clr,
+                         int despillMath, float limit, float customWeight, bool protectTones,
+                         Vector3 protectColor, float protectExponent, float protectEffect)
+  {
+    Vector3 hueIn = HueRotate(rgb, rotation);
     Vector4 despilled(hueIn[0], hueIn[1], hueIn[2], 0.0f);
     customWeight = (customWeight + 1) / 2;
 
@@ -141,16 +168,16 @@ namespace color
       limitResult = (despilled[chans[0]] + despilled[chans[1]]) / 2;
     }
     else if(despillMath == Constants::DESPILL_MAX) {
-      limitResult = MAX(despilled[chans[0]], despilled[chans[1]]);
+      limitResult = Max(despilled[chans[0]], despilled[chans[1]]);
     }
     else if(despillMath == Constants::DESPILL_MIN) {
-      limitResult = MIN(despilled[chans[0]], despilled[chans[1]]);
+      limitResult = Min(despilled[chans[0]], despilled[chans[1]]);
     }
     else {
       limitResult = despilled[chans[0]] * customWeight + despilled[chans[1]] * (1 - customWeight);
     }
 
-    float protectResult;
+    float protectResult = 0.0f;
     bool isProtectDifferent = (protectColor[0] != protectColor[1]) ||
                               (protectColor[0] != protectColor[2]) ||
                               (protectColor[1] != protectColor[2]);
@@ -158,17 +185,17 @@ namespace color
     if(protectTones && isProtectDifferent) {
       float cosProtectAngle;
       cosProtectAngle = cosAngleBetween(rgb, protectColor);
-      cosProtectAngle = clamp(cosProtectAngle, 0.0f, 1.0f);
-      protectResult = std::pow(cosProtectAngle, 1 / std::pow(protectTolerance, protectFalloff));
+      cosProtectAngle = Clamp(cosProtectAngle, 0.0f, 1.0f);
+      protectResult = Tier::Pow(cosProtectAngle, protectExponent);
       limitResult = limitResult * (1 + protectResult * protectEffect);
     }
 
     for(int c = 0; c < 3; c++) {
-      despilled[c] = c == _clr ? MIN(despilled[c], limitResult * limit) : despilled[c];
+      despilled[c] = c == _clr ? Min(despilled[c], limitResult * limit) : despilled[c];
     }
 
     Vector3 rgbDespilled(despilled.x, despilled.y, despilled.z);
-    rgbDespilled = HueRotate(rgbDespilled, -hueShift);
+    rgbDespilled = HueRotate(rgbDespilled, rotation.Inverse());
     despilled.x = rgbDespilled.x;
     despilled.y = rgbDespilled.y;
     despilled.z = rgbDespilled.z;
@@ -177,7 +204,129 @@ namespace color
     return despilled;
   }
 
-  float GetLuma(const Vector3 rgb, int math)
+  // despill with a zero limit strength: the spill channel is clamped to 0, so the
+  // limit mix and the protect weighting cancel out and are skipped
+  inline Vector4 DespillZeroLimit(const Vector3 rgb, const HueRotation &rotation, int _clr)
+  {
+    Vector3 hueIn = HueRotate(rgb, rotation);
+    hueIn[_clr] = Min(hueIn[_clr], 0.0f);
+
+    Vector3 rgbDespilled = HueRotate(hueIn, rotation.Inverse());
+    return Vector4(rgbDespilled.x, rgbDespilled.y, rgbDespilled.z, 0.0f);
+  }
+
+  // row constant setup of the spill-free pre-test. the hue rotation is linear, so
+  // the rotated spill channel and the two channels that limit it are dot products
+  struct SpillTest {
+    float spill[3];
+    float chanA[3];
+    float chanB[3];
+    int despillMath;
+    float weight;
+    bool protect;
+  };
+
+  inline SpillTest MakeSpillTest(float hueShift, int _clr, int despillMath, float customWeight,
+                                 bool protect)
+  {
+    SpillTest test;
+    HueRotation rotation = MakeHueRotation(hueShift);
+    int chanA = _clr == Constants::COLOR_RED ? Constants::COLOR_GREEN : Constants::COLOR_RED;
+    int chanB = _clr == Constants::COLOR_BLUE ? Constants::COLOR_GREEN : Constants::COLOR_BLUE;
+
+    // rotated basis vectors are the columns of the rotation matrix
+    for(int c = 0; c < 3; c++) {
+      Vector3 basis(c == 0 ? 1.0f : 0.0f, c == 1 ? 1.0f : 0.0f, c == 2 ? 1.0f : 0.0f);
+      Vector3 column = HueRotate(basis, rotation);
+      test.spill[c] = column[_clr];
+      test.chanA[c] = column[chanA];
+      test.chanB[c] = column[chanB];
+    }
+
+    test.despillMath = despillMath;
+    test.weight = (customWeight + 1) / 2;
+    test.protect = protect;
+    return test;
+  }
+
+  // limit of the spill channel from the two rotated channels that bound it. the
+  // despill math is a template argument, so the block loops below carry no branch
+  template <int kMath>
+  inline float SpillLimit(float a, float c, float weight)
+  {
+    return kMath == Constants::DESPILL_AVERAGE ? (a + c) / 2
+           : kMath == Constants::DESPILL_MAX   ? Max(a, c)
+           : kMath == Constants::DESPILL_MIN   ? Min(a, c)
+                                               : a * weight + c * (1 - weight);
+  }
+
+  // true when no pixel of the block has its rotated spill channel above the limit,
+  // so Despill would hand back the input unchanged. with tone protection the limit
+  // only grows when it is positive, so the test is kept conservative there. this is
+  // the contiguous planar form, kWidth pixels of r, g and b side by side
+  template <int kMath, int kWidth>
+  inline bool SpillFreePlanar(const SpillTest &test, const float *r, const float *g,
+                              const float *b, const float *strength)
+  {
+    int over = 0;
+    for(int i = 0; i < kWidth; i++) {
+      float spill = test.spill[0] * r[i] + test.spill[1] * g[i] + test.spill[2] * b[i];
+      float a = test.chanA[0] * r[i] + test.chanA[1] * g[i] + test.chanA[2] * b[i];
+      float c = test.chanB[0] * r[i] + test.chanB[1] * g[i] + test.chanB[2] * b[i];
+      float limitResult = SpillLimit<kMath>(a, c, test.weight) * strength[i];
+
+      // written as !(<=) so NaN pixels always take the full path
+      over |= int(!(spill <= limitResult)) | int(test.protect && limitResult < 0.0f);
+    }
+    return over == 0;
+  }
+
+  // interleaved form, stride is the distance in floats between neighbouring pixels.
+  // the block is gathered into planes first so the test itself stays the planar loop
+  template <int kMath, int kWidth>
+  inline bool SpillFreeInterleaved(const SpillTest &test, const float *r, const float *g,
+                                   const float *b, ptrdiff_t stride, const float *strength)
+  {
+    float pr[kWidth], pg[kWidth], pb[kWidth];
+    for(int i = 0; i < kWidth; i++) {
+      pr[i] = r[i * stride];
+      pg[i] = g[i * stride];
+      pb[i] = b[i * stride];
+    }
+    return SpillFreePlanar<kMath, kWidth>(test, pr, pg, pb, strength);
+  }
+
+  template <int kMath, int kWidth>
+  inline bool SpillFreePlanarBlock(const SpillTest &test, const float *r, const float *g,
+                                   const float *b, ptrdiff_t, const float *strength)
+  {
+    return SpillFreePlanar<kMath, kWidth>(test, r, g, b, strength);
+  }
+
+  typedef bool (*SpillFreeBlockFn)(const SpillTest &, const float *, const float *,
+                                   const float *, ptrdiff_t, const float *);
+
+  // block test for a span, picked once from the despill math and the pixel layout
+  template <int kWidth>
+  inline SpillFreeBlockFn SelectSpillFreeBlock(int despillMath, bool planar)
+  {
+    switch(despillMath) {
+      case Constants::DESPILL_AVERAGE:
+        return planar ? SpillFreePlanarBlock<Constants::DESPILL_AVERAGE, kWidth>
+                      : SpillFreeInterleaved<Constants::DESPILL_AVERAGE, kWidth>;
+      case Constants::DESPILL_MAX:
+        return planar ? SpillFreePlanarBlock<Constants::DESPILL_MAX, kWidth>
+                      : SpillFreeInterleaved<Constants::DESPILL_MAX, kWidth>;
+      case Constants::DESPILL_MIN:
+        return planar ? SpillFreePlanarBlock<Constants::DESPILL_MIN, kWidth>
+                      : SpillFreeInterleaved<Constants::DESPILL_MIN, kWidth>;
+      default:
+        return planar ? SpillFreePlanarBlock<Constants::DESPILL_CUSTOM, kWidth>
+                      : SpillFreeInterleaved<Constants::DESPILL_CUSTOM, kWidth>;
+    }
+  }
+
+  inline float GetLuma(const Vector3 rgb, int math)
   {
     float luma;
     switch(math) {
@@ -203,7 +352,7 @@ namespace color
     return luma;
   }
 
-  float LumaRange(float spillLuma, float blackPoint = 0.0f, float whitePoint = 1.0f)
+  inline float LumaRange(float spillLuma, float blackPoint = 0.0f, float whitePoint = 1.0f)
   {
     if(blackPoint <= 0.0f && whitePoint >= 1.0f) return spillLuma;
 
@@ -211,7 +360,140 @@ namespace color
     if(range <= 0.0f) return spillLuma;
 
     float normalized = (spillLuma - blackPoint) / range;
-    return clamp(normalized, 0.0f, 1.0f);
+    return Clamp(normalized, 0.0f, 1.0f);
+  }
+
+  // knob state of the per pixel path, set once per validate
+  struct PixelParams {
+    int clr;
+    int despillMath;
+    float customWeight;
+    bool protectTones;
+    bool protectPreview;
+    float protectColor[3];
+    float protectExponent;  // ProtectExponent of the tolerance and falloff
+    float protectEffect;
+    bool absMode;
+    int respillMath;
+    float blackPoint;
+    float whitePoint;
+    int outputType;
+    bool outputAlpha;
+    bool invertAlpha;
+  };
+
+  // spill estimate of one pixel: the despilled rgb, the removed spill and its luma,
+  // normalized to the spill color in abs mode. limit is the despill strength,
+  // zeroLimit flags a known zero strength for the reduced kernel. not for the
+  // protect preview
+  template <typename Tier = fastmath::ExactTier>
+  inline void SpillPixel(const PixelParams &p, const Vector3 rgb, const Vector3 despillColor,
+                         const HueRotation &rotation, float limit, bool zeroLimit,
+                         Vector3 &despilledRGB, Vector3 &spillFull, float &spillLumaFull)
+  {
+    Vector3 protectColor(p.protectColor);
+
+    // perform limit operation
+    Vector4 rawDespilled =
+        zeroLimit ? DespillZeroLimit(rgb, rotation, p.clr)
+                  : Despill<Tier>(rgb, rotation, p.clr, p.despillMath, limit, p.customWeight,
+                                  p.protectTones, protectColor, p.protectExponent,
+                                  p.protectEffect);
+
+    // calculate spill amount (difference between rgb and raw despilled)
+    Vector3 spillVec = {
+        rgb[0] - rawDespilled.x,
+        rgb[1] - rawDespilled.y,
+        rgb[2] - rawDespilled.z,
+    };
+
+    float spillLuma = GetLuma(spillVec, p.respillMath);
+
+    // process key generation and normalization
+    if(!p.absMode) {
+      // relative mode: use calculated values
+      despilledRGB = {rawDespilled.x, rawDespilled.y, rawDespilled.z};
+      spillFull = spillVec;
+      spillLumaFull = spillLuma;
+    }
+    else {
+      // absolute mode: normalize spill relative to picked color
+      // calculate how much the picked color would be despilled
+      Vector4 pickDespilled =
+          zeroLimit ? DespillZeroLimit(despillColor, rotation, p.clr)
+                    : Despill<Tier>(despillColor, rotation, p.clr, p.despillMath, limit,
+                                    p.customWeight, p.protectTones, protectColor,
+                                    p.protectExponent, p.protectEffect);
+
+      Vector3 pickSpill = {
+          despillColor.x - pickDespilled.x,
+          despillColor.y - pickDespilled.y,
+          despillColor.z - pickDespilled.z,
+      };
+
+      float pickSpillLuma = GetLuma(pickSpill, p.respillMath);
+
+      // normalize current spill relative to picked color spill
+      spillLumaFull = (pickSpillLuma == 0.0f) ? 0.0f : spillLuma / pickSpillLuma;
+      spillFull = despillColor * spillLumaFull;
+      despilledRGB = rgb - spillFull;
+    }
+  }
+
+  // output rgb and spill alpha of one pixel from its spill estimate
+  inline void ComposePixel(const PixelParams &p, const Vector3 despilledRGB,
+                           const Vector3 spillFull, float spillLumaFull, const Vector3 respill,
+                           float inputAlpha, Vector3 &out, float &outAlpha)
+  {
+    // output type: despilled image with respill color added back, or spill matte
+    if(p.outputType == Constants::OUTPUT_DESPILL) {
+      float rangeLuma = LumaRange(spillLumaFull, p.blackPoint, p.whitePoint);
+      out = despilledRGB + respill * rangeLuma;
+      spillLumaFull = rangeLuma;
+    }
+    else {
+      out = spillFull;
+    }
+
+    // determine alpha output value
+    if(!p.outputAlpha) {
+      // pass the original input alpha channel
+      outAlpha = inputAlpha;
+    }
+    else if(!p.invertAlpha) {
+      // output spill amount as alpha channel
+      outAlpha = spillLumaFull;
+    }
+    else {
+      // output inverted spill amount as alpha channel
+      outAlpha = 1.0f - spillLumaFull;
+    }
+  }
+
+  // full despill and respill of one pixel. returns false when the spill alpha is
+  // left untouched (protect preview)
+  template <typename Tier = fastmath::ExactTier>
+  inline bool DespillPixel(const PixelParams &p, const Vector3 rgb, const Vector3 despillColor,
+                           const HueRotation &rotation, float limit, bool zeroLimit,
+                           const Vector3 respill, float inputAlpha, Vector3 &out,
+                           float &outAlpha)
+  {
+    // case: if tones are protected, output protection matte
+    if(p.protectPreview && p.protectTones) {
+      Vector4 rawDespilled =
+          Despill<Tier>(rgb, rotation, p.clr, p.despillMath, limit, p.customWeight,
+                        p.protectTones, Vector3(p.protectColor), p.protectExponent,
+                        p.protectEffect);
+      out = rgb * Clamp(rawDespilled.w * p.protectEffect, 0.0f, 1.0f);
+      return false;
+    }
+
+    Vector3 despilledRGB, spillFull;
+    float spillLumaFull;
+    SpillPixel<Tier>(p, rgb, despillColor, rotation, limit, zeroLimit, despilledRGB, spillFull,
+                     spillLumaFull);
+    ComposePixel(p, despilledRGB, spillFull, spillLumaFull, respill, inputAlpha, out, outAlpha);
+    return true;
   }
 }  // namespace color
 
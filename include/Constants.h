@@ -5,21 +5,38 @@ namespace Constants
 {
   enum OutputType { OUTPUT_DESPILL, OUTPUT_SPILL };
 
-  enum ColorType { COLOR_RED, COLOR_GREEN, COLOR_BLUE, COLOR_PICK };
+  enum ColorType { COLOR_RED, COLOR_GREEN, COLOR_BLUE, COLOR_PICK, COLOR_POINTS };
 
   enum LumaMathType { LUMA_REC709, LUMA_CCIR601, LUMA_REC2020, LUMA_AVERAGE, LUMA_MAX };
 
   enum DespillMathType { DESPILL_AVERAGE, DESPILL_MAX, DESPILL_MIN, DESPILL_CUSTOM };
 
+  enum BlurFilterType { BLUR_NONE, BLUR_BOX, BLUR_GAUSSIAN };
+
+  enum WedgeType { WEDGE_OFF, WEDGE_LAYERS, WEDGE_SHEET };
+
+  // per object plans of the ID input
+  static const int ID_PLANS = 4;
+
+  // spill color control points of the Points color mode
+  static const int SPILL_POINTS = 6;
+
+  // variants of the wedge mode
+  static const int WEDGE_MAX = 16;
+
   static const char *const RESPILL_MATH_TYPES[] = {"Rec 709", "Ccir 601", "Rec 2020",
                                                    "Average", "Max",      0};
 
-  static const char *const COLOR_TYPES[] = {"Red", "Green", "Blue", "Pick", 0};
+  static const char *const COLOR_TYPES[] = {"Red", "Green", "Blue", "Pick", "Points", 0};
 
   static const char *const OUTPUT_TYPES[] = {"Despill", "Spill", 0};
 
   static const char *const DESPILL_MATH_TYPES[] = {"Average", "Max", "Min", "Custom", 0};
 
+  static const char *const BLUR_FILTER_TYPES[] = {"Off", "Box", "Gaussian", 0};
+
+  static const char *const WEDGE_TYPES[] = {"Off", "Layers", "Contact Sheet", 0};
+
 }  // namespace Constants
 
 #endif  // CONSTANTS_H
\ No newline at end of file
@@ -9,9 +9,27 @@ using namespace DD::Image;
 #include "DDImage/Format.h"
 #include "DDImage/Knobs.h"
 #include "DDImage/Row.h"
+#include "DDImage/Thread.h"
 #include "DDImage/Tile.h"
 #include "DDImage/Vector3.h"
 #include "DDImage/Vector4.h"
+#include "include/Blur.h"
+#include "include/Constants.h"
+#include "include/DespillKernel.h"
+#include "include/SpillCache.h"
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace nuke = DD::Image;
 
 #define HELP                                                                   \
   "DespillAP v1.0\n"                                                           \
@@ -45,21 +63,54 @@ class DespillAPIop : public Iop
  public:
   // constructor
   DespillAPIop(Node *node);
+  ~DespillAPIop();
 
-  int minimum_inputs() const { return 4; }
-  int maximum_inputs() const { return 4; }
+  int minimum_inputs() const { return 5; }
+  int maximum_inputs() const { return 5; }
 
   void knobs(Knob_Callback f);
   int knob_changed(Knob *k);
 
+  void append(Hash &hash);
+
   void _validate(bool);
 
   void _request(int x, int y, int r, int t, ChannelMask channels, int count);
 
   void engine(int y, int l, int r, ChannelMask channels, Row &row);
 
+  void _open();
+
+  void _close();
+
   void ProcessCPU(int y, int x, int r, ChannelMask channels, Row &row);
 
+  void ProcessSheet(int y, int x, int r, ChannelMask channels, Row &row);
+
+  void ProcessCached(int y, int x, int r, ChannelMask channels, Row &row);
+
+  // Color and Respill inputs holding one rgb value, read once per input hash on open
+  // and folded into the knob constants from the next validate
+  struct UniformSample {
+    uint64_t hash = 0;
+    bool sampled = false;    // hash was read
+    bool uniform = false;    // every pixel of the box holds value
+    bool requested = false;  // box requested for the current render
+    float value[3] = {0.0f, 0.0f, 0.0f};
+  };
+  bool CachedUniform(int input, const UniformSample &sample, float (&value)[3]);
+  void SampleUniform(int input, UniformSample &sample);
+
+  bool LimitEdgeZero(int edge);
+
+  Box BlurWanted() const;
+  bool BlurRespill(int y, int x, int r, Row &respill);
+  static void BlurBands(unsigned index, unsigned threads, void *data);
+
+  bool CustomWeightInUse() const;
+  bool ProtectShapeInUse() const;
+  void UpdateSharedKnobs();
+
   const char *input_label(int n, char *) const;
   void set_input(int i, Op *op, int input, int offset);
 
@@ -68,6 +119,9 @@ class DespillAPIop : public Iop
   const char *Class() const { return d.name; }
   const char *node_help() const { return HELP; }
 
+  // default node color, set here rather than on tile_color so it is not a knob change
+  unsigned node_color() const { return 0x8b8b8bff; }
+
  private:
   // spill knobs
   bool k_absMode;
@@ -76,6 +130,14 @@ class DespillAPIop : public Iop
   float k_spillPick[3];
   float k_customWeight;
 
+  // spill point knobs
+  struct SpillPointKnobs {
+    bool enable;
+    float position[2];
+    float color[3];
+  };
+  SpillPointKnobs k_spillPoints[Constants::SPILL_POINTS];
+
   // hue knobs
   float k_hueOffset;
   float k_hueLimit;
@@ -95,6 +157,8 @@ class DespillAPIop : public Iop
   // respill knobs
   float k_respillColor[3];
   int k_respillMath;
+  int k_respillBlur;
+  float k_respillBlurSize;
   float k_blackPoint;
   float k_whitePoint;
 
@@ -104,18 +168,168 @@ class DespillAPIop : public Iop
   bool k_invertAlpha;
   Channel k_outputSpillChannel;
 
+  // id plan knobs
+  struct IdPlanKnobs {
+    bool enable;
+    int id;
+    float pick[3];
+    int despillMath;
+    float hueOffset;
+    float hueLimit;
+    bool protectTones;
+    float protectColor[3];
+    float protectTolerance;
+  };
+  Channel k_idChannel;
+  IdPlanKnobs k_idPlans[Constants::ID_PLANS];
+
+  // wedge knobs, the ranges hold the first and last variant
+  int k_wedgeMode;
+  int k_wedgeCount;
+  float k_wedgeOffset[2];
+  float k_wedgeLimit[2];
+  float k_wedgeTolerance[2];
+  bool k_wedgeMath;
+
+  // performance knobs
+  bool k_spillCache;
+  const char *k_spillCacheDir;
+  int k_spillCacheSize;
+  int k_prefetchDepth;
+  float k_prefetchWait;
+
   // connected inputs
   bool isSourceConnected;
   bool isLimitConnected;
   bool isColorConnected;
   bool isRespillConnected;
+  bool isIdConnected;
+
+  // despill kernels of the base and id plans, shared with the core library
+  DespillParams _params;
+  despill::PlanTable _kernel;
+
+  // wedge variants, with the output layers of the Layers mode
+  std::vector<despill::Kernel> _wedgeKernels;
+  Channel _wedgeChannels[Constants::WEDGE_MAX][4];
+  int _sheetColumns;
+
+  // spill estimates of the frame on disk, read when the file of the current key
+  // exists, else collected from the rendered rows and written once complete
+  spillcache::Reader _cacheReader;
+  spillcache::Writer _cacheWriter;
+
+  // limit matte sparsity
+  Box _limitBox;          // bounding box of the Limit input
+  int _limitEdgeZero[2];  // bottom and top box rows of zero strength, -1 until read
+  Lock _limitLock;
+
+  // uniform Color and Respill inputs
+  UniformSample _colorUniform;
+  UniformSample _respillUniform;
+
+  // respill from the blurred source, over the wanted pixels and the reach of the
+  // filter. the box slides windows down the rows, the Gaussian blurs planes once
+  struct BlurFrame {
+    Box area;                   // source pixels of the planes
+    Box valid;                  // pixels whose blur reads inside area
+    std::vector<float> planes;  // blurred rgb planes of area
+  };
+  struct BlurWindow {
+    int x, width;                // source columns of the window
+    blur::BoxWindow window;
+    std::vector<float> blurred;  // rgb lines of the last row
+  };
+  std::shared_ptr<const BlurFrame> BlurSource(const Box &valid, int reach);
+  uint64_t _blurKey;  // source, filter and size the blur is for
+  std::shared_ptr<const BlurFrame> _blurFrame;
+  std::vector<std::unique_ptr<BlurWindow>> _blurWindows;  // idle windows
+  BlurFrame *_blurBuild;  // frame the blur threads fill
+  bool _blurColumns;      // pass the blur threads run, rows then columns
+  Lock _blurLock;
+
+  // work a channel request asks for
+  struct Demand {
+    bool rgb;     // rgb of the main output
+    bool matte;   // spill channel of the main output
+    bool layers;  // any wedge layer
+  };
+  Demand ChannelDemand(ChannelMask channels) const;
+
+  // rows of the auxiliary inputs for one source row
+  struct InputRows {
+    InputRows(int x, int r) : color(x, r), respill(x, r), limit(x, r), id(x, r), limitActive(false)
+    {
+    }
+    Row color, respill, limit, id;
+    bool limitActive;
+  };
+  enum AuxInput { AUX_COLOR, AUX_RESPILL, AUX_ID, AUX_LIMIT, AUX_COUNT };
+  bool InputInUse(int aux, bool readRespill, bool readEstimate) const;
+  bool FetchInput(int aux, int y, int x, int r, bool readRespill, bool readEstimate,
+                  InputRows &rows);
+  bool FetchInputs(int y, int x, int r, bool readRespill, bool readEstimate, InputRows &rows);
+
+  // input rows of a source row, each input fetched by a prefetch worker or by the row
+  // itself when no worker has taken it yet. the states change under _prefetchMutex
+  struct InputFetch {
+    enum State { QUEUED, RUNNING, DONE };
+    InputFetch(int y, int x, int r, bool readRespill)
+        : rows(x, r), y(y), x(x), r(r), readRespill(readRespill), pending(0), fetched(true)
+    {
+      std::fill(state, state + AUX_COUNT, DONE);
+    }
+    InputRows rows;
+    int y, x, r;
+    bool readRespill;
+    State state[AUX_COUNT];
+    int pending;   // inputs not done
+    bool fetched;  // false once an input failed or was skipped
+  };
+  struct FetchTask {
+    std::shared_ptr<InputFetch> fetch;
+    int aux;
+  };
+  std::shared_ptr<InputFetch> MakeFetch(int y, int x, int r, bool readRespill) const;
+  void QueueFetch(const std::shared_ptr<InputFetch> &fetch);
+  void SkipFetch(InputFetch &fetch);
+  std::shared_ptr<InputFetch> QueueInputs(int y, int x, int r, bool readRespill);
+  bool WaitInputs(InputFetch &fetch);
+  void RunFetch(std::unique_lock<std::mutex> &lock, InputFetch &fetch, int aux);
+  void PrefetchWorker();
+  void DropPrefetch(std::unique_lock<std::mutex> &lock);
+  void StopPrefetch();
+
+  // input rows queued ahead of the rendered rows, row y in slot y % size. a slot
+  // keeps its y once taken so the row is not queued again
+  struct PrefetchSlot {
+    int y = INT_MIN;
+    std::shared_ptr<InputFetch> fetch;
+  };
+  int _prefetchDepth;                  // rows ahead of each rendered row, from open
+  int _requestX, _requestY;            // area requested of the node, no row past it is
+  int _requestR, _requestT;            // queued and the respill blur is made for it
+  std::vector<PrefetchSlot> _prefetchRing;
+  std::deque<FetchTask> _prefetchQueue;
+  std::vector<std::thread> _prefetchWorkers;  // started on open, joined on close
+  int _prefetchRunning;                       // fetches the workers are running
+  bool _prefetchStop;
+  std::mutex _prefetchMutex;
+  std::condition_variable _prefetchWake;  // a fetch was queued, or the workers stop
+  std::condition_variable _prefetchDone;  // a fetch is done
+
+  // time the rows waited on their input rows since the last close, and in the last
+  // render with prefetch on
+  std::atomic<int64_t> _fetchWaitUs;
+  std::atomic<int64_t> _prefetchWaitUs;
+
+  // key of the disk cache: the parameters shaping the spill estimate and the inputs
+  // it reads
+  uint64_t SpillKey();
 
-  // internal variables
-  float _hueShift;
-  int _clr;
-  int _usePickedColor;
-  int _returnColor;
-  Vector3 normVec;
+  // points image at the rows from x on, every step-th pixel
+  void SetInputs(const Row &source, const InputRows &rows, int x, int step, bool readAlpha,
+                 DespillImage &image) const;
 };
 
 #endif  // DESPILL_AP_H
\ No newline at end of file
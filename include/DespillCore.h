@@ -0,0 +1,223 @@
+#ifndef DESPILL_CORE_H
+#define DESPILL_CORE_H
+
+/*
+ * DespillCore: the DespillAP despill/respill pipeline as a C API.
+ *
+ * The Nuke plugin runs the same kernel (src/DespillKernel.cpp), so a given set of
+ * parameters gives the same numbers in Nuke and in any tool linking this library.
+ *
+ * Buffers are described by one base pointer per channel plus a pixel stride and a
+ * row stride, both counted in floats. That covers interleaved RGBA (channels at
+ * p, p + 1, p + 2, p + 3 with a pixel stride of 4) and planar images (one plane
+ * per channel with a pixel stride of 1) without copying. Output may alias the
+ * source for in-place processing.
+ */
+
+#include <stddef.h>
+
+#if defined(DESPILL_CORE_SHARED)
+#if defined(_WIN32)
+#if defined(DESPILL_CORE_BUILD)
+#define DESPILL_API __declspec(dllexport)
+#else
+#define DESPILL_API __declspec(dllimport)
+#endif
+#else
+#define DESPILL_API __attribute__((visibility("default")))
+#endif
+#else
+#define DESPILL_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* values match the knob enumerations of the plugin (Constants.h) */
+enum DespillColorType {
+  DESPILL_COLOR_RED = 0,
+  DESPILL_COLOR_GREEN = 1,
+  DESPILL_COLOR_BLUE = 2,
+  DESPILL_COLOR_PICK = 3,
+  DESPILL_COLOR_POINTS = 4
+};
+
+/* spill color control points of DESPILL_COLOR_POINTS */
+#define DESPILL_MAX_POINTS 8
+
+enum DespillMath {
+  DESPILL_MATH_AVERAGE = 0,
+  DESPILL_MATH_MAX = 1,
+  DESPILL_MATH_MIN = 2,
+  DESPILL_MATH_CUSTOM = 3
+};
+
+enum DespillLumaMath {
+  DESPILL_LUMA_REC709 = 0,
+  DESPILL_LUMA_CCIR601 = 1,
+  DESPILL_LUMA_REC2020 = 2,
+  DESPILL_LUMA_AVERAGE = 3,
+  DESPILL_LUMA_MAX = 4
+};
+
+enum DespillOutputType { DESPILL_OUTPUT_DESPILL = 0, DESPILL_OUTPUT_SPILL = 1 };
+
+enum DespillBlurFilter { DESPILL_BLUR_NONE = 0, DESPILL_BLUR_BOX = 1, DESPILL_BLUR_GAUSSIAN = 2 };
+
+/* DESPILL_ERROR_RESOURCE: memory ran out, the output may be incomplete */
+enum DespillStatus { DESPILL_OK = 0, DESPILL_ERROR_ARGUMENT = 1, DESPILL_ERROR_RESOURCE = 2 };
+
+/* mirrors the knobs of the DespillAP node, see despill_params_init for defaults */
+typedef struct DespillParams {
+  /* spill */
+  int colorType;       /* DespillColorType, ignored when colorConnected */
+  float spillPick[3];  /* picked spill color for DESPILL_COLOR_PICK */
+  int absMode;         /* normalize spill relative to the spill color */
+  int despillMath;     /* DespillMath */
+  float customWeight;  /* -1..1, DESPILL_MATH_CUSTOM only */
+
+  /* spill points, DESPILL_COLOR_POINTS only */
+  int pointCount;                             /* points in use, 0 passes through */
+  float pointPosition[DESPILL_MAX_POINTS][2]; /* frame pixels, see DespillImage x and y */
+  float pointColor[DESPILL_MAX_POINTS][3];    /* spill color sampled at each point */
+  int frameWidth;                             /* frame covered by the interpolated color */
+  int frameHeight;
+
+  /* hue */
+  float hueOffset; /* degrees */
+  float hueLimit;  /* despill strength, multiplied by the limit matte */
+  int invertLimit; /* use 1 - limit */
+
+  /* protect tones */
+  int protectTones;
+  int protectPreview;
+  float protectColor[3];
+  float protectTolerance;
+  float protectFalloff;
+  float protectEffect;
+
+  /* respill */
+  int respillMath; /* DespillLumaMath */
+  float respillColor[3];
+  int respillBlur;       /* DespillBlurFilter, respill from the blurred source times respillColor */
+  float respillBlurSize; /* blur radius in pixels */
+  float blackPoint;
+  float whitePoint;
+
+  /* output */
+  int outputType;  /* DespillOutputType */
+  int outputAlpha; /* write the spill alpha, else pass the source alpha */
+  int invertAlpha;
+
+  /* auxiliary inputs in use */
+  int colorConnected;   /* per pixel spill color from DespillImage.color */
+  int respillConnected; /* per pixel respill color from DespillImage.respill */
+  int limitConnected;   /* per pixel limit from DespillImage.limit channel 0 */
+} DespillParams;
+
+/* read-only channels, channel[i] is NULL when absent */
+typedef struct DespillInput {
+  const float *channel[4];
+  ptrdiff_t pixelStride;
+  ptrdiff_t rowStride;
+} DespillInput;
+
+/* written channels, channel[i] is NULL when not wanted */
+typedef struct DespillOutput {
+  float *channel[4];
+  ptrdiff_t pixelStride;
+  ptrdiff_t rowStride;
+} DespillOutput;
+
+/*
+ * One image to process. source needs rgb, its alpha (optional) is passed through
+ * when outputAlpha is off and reads as 1 when absent. output rgb is written when its
+ * three channels are set, the spill alpha to output channel 3 when it is not NULL.
+ * Leaving output rgb NULL computes the spill alpha alone, without the respill. An
+ * output alpha is left untouched when the node would bypass (gray pick) or in
+ * protect preview.
+ * A connected limit with a NULL limit.channel[0] row pointer reads as the limit
+ * value of zero strength. respill is ignored when params.respillBlur is set, the
+ * blurred source is built by the library. id channel 0 selects the plan of each
+ * pixel in despill_process_ids. x and y place pixel (0, 0) in the frame of the spill
+ * points, row j of the image is at frame row y + j.
+ *
+ * The spill estimate of a pixel is the spill rgb removed from the source and its
+ * luma before the black and white points, in channels 0-2 and 3. spillOut receives
+ * it when its four channels are set. A spill with its four channels set replaces
+ * the estimate: color, limit and id are not read and only the respill and the
+ * output are computed. Neither is used in protect preview or when the node would
+ * bypass.
+ */
+typedef struct DespillImage {
+  DespillInput source;
+  DespillInput color;
+  DespillInput respill;
+  DespillInput limit;
+  DespillInput id;
+  DespillInput spill;
+  DespillOutput output;
+  DespillOutput spillOut;
+  int width;
+  int height;
+  int x;
+  int y;
+} DespillImage;
+
+/*
+ * Parameters for the pixels of one object: pixels whose id channel rounds to id
+ * use params instead of the base parameters.
+ */
+typedef struct DespillIdPlan {
+  int id;
+  DespillParams params;
+} DespillIdPlan;
+
+/* fills params with the knob defaults of the node */
+DESPILL_API void despill_params_init(DespillParams *params);
+
+/* describes an interleaved RGBA buffer, rowStride in floats (0 = width * 4) */
+DESPILL_API void despill_input_rgba(DespillInput *input, const float *rgba, int width,
+                                    ptrdiff_t rowStride);
+DESPILL_API void despill_output_rgba(DespillOutput *output, float *rgba, int width,
+                                     ptrdiff_t rowStride);
+
+/* describes planar buffers, alpha may be NULL, rowStride in floats (0 = width) */
+DESPILL_API void despill_input_planar(DespillInput *input, const float *r, const float *g,
+                                      const float *b, const float *a, int width,
+                                      ptrdiff_t rowStride);
+DESPILL_API void despill_output_planar(DespillOutput *output, float *r, float *g, float *b,
+                                       float *a, int width, ptrdiff_t rowStride);
+
+/* processes the whole image on the calling thread */
+DESPILL_API int despill_process(const DespillParams *params, const DespillImage *image);
+
+/* processes the whole image split in row bands, threads <= 0 uses every core */
+DESPILL_API int despill_process_parallel(const DespillParams *params, const DespillImage *image,
+                                         int threads);
+
+/*
+ * processes the whole image in a single pass with per object parameters. the
+ * respill and limit inputs in use and the respill blur of every plan follow the base
+ * params, a plan may use its own spill color or the color input
+ */
+DESPILL_API int despill_process_ids(const DespillParams *params, const DespillIdPlan *plans,
+                                    int planCount, const DespillImage *image, int threads);
+
+/*
+ * processes count parameter sets (a wedge) in a single pass over the inputs:
+ * params[i] is written to outputs[i] and image->output is ignored. every variant of
+ * a row runs before the next row, so the inputs are read once for all of them. the
+ * respill and limit inputs in use and the respill blur follow params[0]. outputs
+ * must not alias the source
+ */
+DESPILL_API int despill_process_wedge(const DespillParams *params, int count,
+                                      const DespillImage *image, const DespillOutput *outputs,
+                                      int threads);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DESPILL_CORE_H */
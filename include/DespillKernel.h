@@ -0,0 +1,112 @@
+#ifndef DESPILL_KERNEL_H
+#define DESPILL_KERNEL_H
+
+#include <vector>
+
+#include "include/Color.h"
+#include "include/DespillCore.h"
+
+namespace despill
+{
+  // knob defaults of the node
+  DespillParams DefaultParams();
+
+  // spill color of the Points color mode. the sparse points are spread over a coarse
+  // grid of the frame once per Prepare, pixels interpolate the four nearest nodes
+  class SpillGrid
+  {
+   public:
+    void Build(const DespillParams &params);
+
+    // hue shift in degrees of the spill color at frame position (fx, fy), and the
+    // spill color itself when color is not null
+    float Sample(float fx, float fy, color::Vector3 *color) const;
+
+   private:
+    static const int kSpacing = 32;  // frame pixels between nodes
+
+    int _columns = 0;
+    int _rows = 0;
+    std::vector<float> _nodes;  // hue shift, r, g, b per node, row by row
+  };
+
+  // despill/respill pipeline shared by the Nuke plugin and the core library.
+  // Prepare derives the row constant state from the knob values, ProcessRow only
+  // reads it and can run on several threads at once
+  class Kernel
+  {
+   public:
+    Kernel();
+
+    void Prepare(const DespillParams &params);
+
+    // processes row y of image
+    void ProcessRow(const DespillImage &image, int y) const;
+
+    // processes the pixels [x, r) of row y
+    void ProcessSpan(const DespillImage &image, int y, int x, int r) const;
+
+    const DespillParams &Params() const { return _params; }
+
+    // no valid spill color picked, the input passes through unchanged
+    bool Bypass() const { return _bypass; }
+
+    // limit matte value that gives zero despill strength
+    float LimitZero() const { return _limitZero; }
+
+    // despill strength is zero over the whole frame
+    bool ZeroStrength() const { return _zeroStrength; }
+
+   private:
+    DespillParams _params;
+
+    int _clr;
+    int _usePickedColor;
+    float _hueShift;
+    color::HueRotation _hueRotation;  // cos and sin of _hueShift, taken once in Prepare
+    bool _bypass;
+    color::Vector3 _despillColor;  // spill color when the Color input is not in use
+    bool _usePoints;               // spill color from the spill points
+    SpillGrid _spillGrid;
+
+    float _limitZero;
+    bool _zeroStrength;
+
+    // spill-free block pre-test
+    bool _spillTest;
+    color::SpillTest _spillTestSetup;
+    float _cleanLuma;   // respill luma of a pixel with no spill
+    float _cleanAlpha;  // spill alpha of a pixel with no spill
+
+    color::PixelParams _pixelParams;
+  };
+
+  // per object plans picked by the id channel of the image, one kernel per plan.
+  // pixels whose id has no plan use the base parameters
+  class PlanTable
+  {
+   public:
+    void Prepare(const DespillParams &base, const DespillIdPlan *plans, int count);
+
+    // processes row y of image, split in runs of equal id
+    void ProcessRow(const DespillImage &image, int y) const;
+
+    const Kernel &Base() const { return _base; }
+    bool HasPlans() const { return !_plans.empty(); }
+
+    // every plan passes the input through
+    bool Bypass() const;
+
+    // despill strength is zero over the whole frame for every plan
+    bool ZeroStrength() const;
+
+   private:
+    const Kernel &Lookup(float value) const;
+
+    Kernel _base;
+    std::vector<int> _ids;  // sorted plan ids
+    std::vector<Kernel> _plans;
+  };
+}  // namespace despill
+
+#endif  // DESPILL_KERNEL_H
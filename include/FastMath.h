@@ -0,0 +1,284 @@
+#ifndef FAST_MATH_H
+#define FAST_MATH_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include "include/Constants.h"
+
+namespace fastmath
+{
+  static const float kPi = 3.14159265358979323846f;
+  static const float kTwoPi = 6.28318530717958647692f;
+  static const float kHalfPi = 1.57079632679489661923f;
+
+  inline uint32_t FloatBits(float f)
+  {
+    uint32_t bits;
+    std::memcpy(&bits, &f, sizeof(bits));
+    return bits;
+  }
+
+  inline float BitsFloat(uint32_t bits)
+  {
+    float f;
+    std::memcpy(&f, &bits, sizeof(f));
+    return f;
+  }
+
+  // splits a positive normal float into exponent and a mantissa in [sqrt(1/2),
+  // sqrt(2)), centered on 1. the offset moves the split point to sqrt(2), so there is
+  // no branch on the mantissa
+  inline void SplitFloat(float x, int &exponent, float &mantissa)
+  {
+    uint32_t bits = FloatBits(x);
+    exponent = static_cast<int>((bits + (0x3f800000u - 0x3f3504f3u)) >> 23) - 127;
+    mantissa = BitsFloat(bits - (static_cast<uint32_t>(exponent) << 23));
+  }
+
+  // largest integer not above x, without the libm call of std::floor. x is kept
+  // well inside the int range by the callers
+  inline int FloorInt(float x)
+  {
+    int n = static_cast<int>(x);
+    return n - (x < static_cast<float>(n) ? 1 : 0);
+  }
+
+  // 2^n for -126 <= n <= 127, straight from the exponent bits
+  inline float Pow2Int(int n)
+  {
+    return BitsFloat(static_cast<uint32_t>(n + 127) << 23);
+  }
+
+  // flips the sign of x when n is odd
+  inline float FlipSign(float x, int n)
+  {
+    return BitsFloat(FloatBits(x) ^ (static_cast<uint32_t>(n) << 31));
+  }
+
+  namespace poly
+  {
+    // the angle is reduced by the nearest multiple of pi in two steps, an odd
+    // multiple flips the sign. sin(r) / r is fit in r^2 on [0, pi/2], error below
+    // 1e-8. angles past the int range go to the standard library
+    inline float Sin(float x)
+    {
+      float turns = x * (1.0f / kPi);
+      if(!(std::fabs(turns) < 1e9f)) return std::sin(x);
+
+      int n = FloorInt(turns + 0.5f);
+      float r = (x - static_cast<float>(n) * 3.140625f) -
+                static_cast<float>(n) * 9.67653589793e-4f;
+      float r2 = r * r;
+      float s = r * (0.999999996f +
+                     r2 * (-0.166666579f +
+                           r2 * (8.33305017e-3f + r2 * (-1.98090174e-4f + r2 * 2.60510764e-6f))));
+      return FlipSign(s, n);
+    }
+
+    inline float Cos(float x)
+    {
+      return Sin(x + kHalfPi);
+    }
+
+    // abramowitz & stegun 4.4.46, error below 2e-8
+    inline float Acos(float x)
+    {
+      bool negative = x < 0.0f;
+      float a = negative ? -x : x;
+      if(!(a <= 1.0f)) return NAN;
+
+      float p = 1.5707963050f +
+                a * (-0.2145988016f +
+                     a * (0.0889789874f +
+                          a * (-0.0501743046f +
+                               a * (0.0308918810f +
+                                    a * (-0.0170881256f +
+                                         a * (0.0066700901f + a * -0.0012624911f))))));
+      float r = std::sqrt(1.0f - a) * p;
+      return negative ? kPi - r : r;
+    }
+
+    // log2 of the mantissa through the atanh series, exponent from the float bits.
+    // the mantissa is centered on 1 so the series converges fast, error below 1e-8
+    inline float Log2(float x)
+    {
+      int exponent;
+      float m;
+      SplitFloat(x, exponent, m);
+
+      float z = (m - 1.0f) / (m + 1.0f);
+      float z2 = z * z;
+      float ln = 2.0f * z *
+                 (1.0f + z2 * (1.0f / 3.0f + z2 * (1.0f / 5.0f + z2 * (1.0f / 7.0f + z2 / 9.0f))));
+      return static_cast<float>(exponent) + ln * 1.44269504088896340736f;
+    }
+
+    // 2^f on the fractional part is fit with its constant term held at 1, so whole
+    // powers stay exact, error below 3e-7
+    inline float Exp2(float x)
+    {
+      if(x != x) return x;
+      if(x < -126.0f) return 0.0f;
+      if(x >= 128.0f) return INFINITY;
+
+      int n = FloorInt(x);
+      float f = x - static_cast<float>(n);
+      float e = 1.0f +
+                f * (0.693147568f +
+                     f * (0.240207194f +
+                          f * (5.56570544e-2f + f * (9.19938760e-3f + f * 1.78836874e-3f))));
+      return e * Pow2Int(n);
+    }
+  }  // namespace poly
+
+  namespace lut
+  {
+    static const int kSinSize = 16384;
+    static const int kAcosSize = 1024;
+    static const int kLogSize = 1024;
+    static const int kExpSize = 1024;
+
+    // mantissa range of the log2 table, centered on 1 like the poly tier
+    static const float kLogLo = 0.70710678f;
+    static const float kLogHi = 1.41421357f;
+
+    // tables are built once, on first use, with linear interpolation between entries
+    struct Tables {
+      float sin[kSinSize + 1];
+      float acos[kAcosSize + 1];  // acos(x) / sqrt(1 - x), smooth on [0, 1]
+      float log2[kLogSize + 1];   // log2(m) / (m - 1) on [kLogLo, kLogHi], smooth at 1
+      float exp2[kExpSize + 1];   // 2^x on [0, 1]
+
+      Tables()
+      {
+        for(int i = 0; i <= kSinSize; i++) {
+          sin[i] = static_cast<float>(std::sin(6.28318530717958647692 * i / kSinSize));
+        }
+        for(int i = 0; i < kAcosSize; i++) {
+          double a = static_cast<double>(i) / kAcosSize;
+          acos[i] = static_cast<float>(std::acos(a) / std::sqrt(1.0 - a));
+        }
+        acos[kAcosSize] = static_cast<float>(std::sqrt(2.0));
+        for(int i = 0; i <= kLogSize; i++) {
+          double m = kLogLo + (static_cast<double>(kLogHi) - kLogLo) * i / kLogSize;
+          log2[i] = static_cast<float>(std::fabs(m - 1.0) < 1e-9 ? 1.44269504088896340736
+                                                                  : std::log2(m) / (m - 1.0));
+        }
+        for(int i = 0; i <= kExpSize; i++) {
+          exp2[i] = static_cast<float>(std::exp2(static_cast<double>(i) / kExpSize));
+        }
+      }
+    };
+
+    inline const Tables &GetTables()
+    {
+      static const Tables tables;
+      return tables;
+    }
+
+    // t is in table units, 0 <= t <= size
+    inline float Lerp(const float *table, float t, int size)
+    {
+      int i = static_cast<int>(t);
+      if(i >= size) return table[size];
+      float f = t - static_cast<float>(i);
+      return table[i] + (table[i + 1] - table[i]) * f;
+    }
+
+    // kSinSize is a power of two, the index wraps to one turn with a mask. angles
+    // past the int range go to the standard library
+    inline float Sin(float x)
+    {
+      float t = x * (kSinSize / kTwoPi);
+      if(!(std::fabs(t) < 1e9f)) return std::sin(x);
+
+      int i = FloorInt(t);
+      float f = t - static_cast<float>(i);
+      const float *table = GetTables().sin + (i & (kSinSize - 1));
+      return table[0] + (table[1] - table[0]) * f;
+    }
+
+    inline float Cos(float x)
+    {
+      return Sin(x + kHalfPi);
+    }
+
+    inline float Acos(float x)
+    {
+      bool negative = x < 0.0f;
+      float a = negative ? -x : x;
+      if(!(a <= 1.0f)) return NAN;
+
+      float r = std::sqrt(1.0f - a) * Lerp(GetTables().acos, a * kAcosSize, kAcosSize);
+      return negative ? kPi - r : r;
+    }
+
+    // the mantissa is centered on 1 and m - 1 is exact, so a value just below a power
+    // of two does not lose its log to the cancellation of exponent and mantissa
+    inline float Log2(float x)
+    {
+      int exponent;
+      float m;
+      SplitFloat(x, exponent, m);
+      float t = (m - kLogLo) * (kLogSize / (kLogHi - kLogLo));
+      float l = (m - 1.0f) * Lerp(GetTables().log2, t, kLogSize);
+      return static_cast<float>(exponent) + l;
+    }
+
+    inline float Exp2(float x)
+    {
+      if(x != x) return x;
+      if(x < -126.0f) return 0.0f;
+      if(x >= 128.0f) return INFINITY;
+
+      int n = FloorInt(x);
+      float e = Lerp(GetTables().exp2, (x - static_cast<float>(n)) * kExpSize, kExpSize);
+      return e * Pow2Int(n);
+    }
+  }  // namespace lut
+
+  // math tiers of the despill functions in Color.h, angles in radians. a tier is a
+  // template argument, so its calls inline into the pixel loop. the kernel runs the
+  // Exact tier: with the hue rotation taken once per shift, Fast and LUT measured no
+  // faster than the standard library in the accuracy harness, which keeps timing
+  // them against it
+
+  // approximated tiers handle positive normal bases, anything else goes to std::pow
+  inline bool PowInRange(float base)
+  {
+    return base >= 1.17549435e-38f && base != INFINITY;
+  }
+
+  struct ExactTier {
+    static float Sin(float x) { return std::sin(x); }
+    static float Cos(float x) { return std::cos(x); }
+    static float Acos(float x) { return std::acos(x); }
+    static float Pow(float base, float exponent) { return std::pow(base, exponent); }
+  };
+
+  struct FastTier {
+    static float Sin(float x) { return poly::Sin(x); }
+    static float Cos(float x) { return poly::Cos(x); }
+    static float Acos(float x) { return poly::Acos(x); }
+    static float Pow(float base, float exponent)
+    {
+      return PowInRange(base) ? poly::Exp2(exponent * poly::Log2(base))
+                              : std::pow(base, exponent);
+    }
+  };
+
+  struct LutTier {
+    static float Sin(float x) { return lut::Sin(x); }
+    static float Cos(float x) { return lut::Cos(x); }
+    static float Acos(float x) { return lut::Acos(x); }
+    static float Pow(float base, float exponent)
+    {
+      return PowInRange(base) ? lut::Exp2(exponent * lut::Log2(base))
+                              : std::pow(base, exponent);
+    }
+  };
+}  // namespace fastmath
+
+#endif  // FAST_MATH_H
@@ -0,0 +1,239 @@
+#ifndef REFERENCE_H
+#define REFERENCE_H
+
+#include <algorithm>
+#include <cmath>
+
+#include "include/Constants.h"
+
+// double precision reference of the despill math in Color.h, used to measure the
+// error of the float kernels and the math tiers of FastMath.h. kept line for line with
+// the float code so any change there must be mirrored here
+namespace reference
+{
+  static const double kPi = 3.14159265358979323846;
+
+  struct Vec3d {
+    double x, y, z;
+
+    Vec3d() : x(0.0), y(0.0), z(0.0) {}
+    Vec3d(double x_, double y_, double z_) : x(x_), y(y_), z(z_) {}
+
+    double &operator[](int i) { return i == 0 ? x : (i == 1 ? y : z); }
+    double operator[](int i) const { return i == 0 ? x : (i == 1 ? y : z); }
+
+    Vec3d operator+(const Vec3d &v) const { return Vec3d(x + v.x, y + v.y, z + v.z); }
+    Vec3d operator-(const Vec3d &v) const { return Vec3d(x - v.x, y - v.y, z - v.z); }
+    Vec3d operator*(double s) const { return Vec3d(x * s, y * s, z * s); }
+
+    double dot(const Vec3d &v) const { return x * v.x + y * v.y + z * v.z; }
+    Vec3d cross(const Vec3d &v) const
+    {
+      return Vec3d(y * v.z - z * v.y, z * v.x - x * v.z, x * v.y - y * v.x);
+    }
+  };
+
+  struct Vec4d {
+    double x, y, z, w;
+  };
+
+  inline double Clamp(double v, double lo, double hi)
+  {
+    return std::min(std::max(v, lo), hi);
+  }
+
+  inline Vec3d HueRotate(const Vec3d &rgb, double angle)
+  {
+    if(angle == 0.0) {
+      return rgb;
+    }
+
+    double cosA = std::cos(angle * kPi / 180.0);
+    double sinA = std::sin(angle * kPi / 180.0);
+    double sqrt3 = std::sqrt(3.0);
+    double common = (rgb.x + rgb.y + rgb.z) * (1.0 - cosA) / 3.0;
+
+    Vec3d hue;
+    hue.x = common + rgb.x * cosA + (-rgb.y / sqrt3 + rgb.z / sqrt3) * sinA;
+    hue.y = common + rgb.y * cosA + (rgb.x / sqrt3 - rgb.z / sqrt3) * sinA;
+    hue.z = common + rgb.z * cosA + (-rgb.x / sqrt3 + rgb.y / sqrt3) * sinA;
+    return hue;
+  }
+
+  inline Vec3d VectorToPlane(const Vec3d &v1, const Vec3d &v2 = Vec3d(1.0, 1.0, 1.0))
+  {
+    return v1 - v2 * (v2.dot(v1) / v2.dot(v2));
+  }
+
+  inline double ColorAngle(const Vec3d &v1, const Vec3d &v2)
+  {
+    double angle = std::acos(v1.dot(v2) / std::sqrt(v1.dot(v1) * v2.dot(v2)));
+    if(Vec3d(1.0, 1.0, 1.0).dot(v1.cross(v2)) > 0.0) {
+      angle = -angle;
+    }
+    return angle;
+  }
+
+  inline double CosAngleBetween(const Vec3d &a, const Vec3d &b)
+  {
+    double magA = std::sqrt(a.dot(a));
+    double magB = std::sqrt(b.dot(b));
+    if(magA == 0.0 || magB == 0.0) return 0.0;
+    return a.dot(b) / (magA * magB);
+  }
+
+  inline Vec4d Despill(const Vec3d &rgb, double hueShift, int _clr, int despillMath,
+                       double limit, double customWeight, bool protectTones,
+                       const Vec3d &protectColor, double protectTolerance, double protectEffect,
+                       double protectFalloff)
+  {
+    Vec3d despilled = HueRotate(rgb, hueShift);
+    customWeight = (customWeight + 1) / 2;
+
+    int chanA = _clr == Constants::COLOR_RED ? Constants::COLOR_GREEN : Constants::COLOR_RED;
+    int chanB = _clr == Constants::COLOR_BLUE ? Constants::COLOR_GREEN : Constants::COLOR_BLUE;
+
+    double limitResult;
+    if(despillMath == Constants::DESPILL_AVERAGE) {
+      limitResult = (despilled[chanA] + despilled[chanB]) / 2;
+    }
+    else if(despillMath == Constants::DESPILL_MAX) {
+      limitResult = std::max(despilled[chanA], despilled[chanB]);
+    }
+    else if(despillMath == Constants::DESPILL_MIN) {
+      limitResult = std::min(despilled[chanA], despilled[chanB]);
+    }
+    else {
+      limitResult = despilled[chanA] * customWeight + despilled[chanB] * (1 - customWeight);
+    }
+
+    double protectResult = 0.0;
+    bool isProtectDifferent = protectColor.x != protectColor.y ||
+                              protectColor.x != protectColor.z || protectColor.y != protectColor.z;
+
+    if(protectTones && isProtectDifferent) {
+      double cosProtectAngle = Clamp(CosAngleBetween(rgb, protectColor), 0.0, 1.0);
+      protectResult =
+          std::pow(cosProtectAngle, 1 / std::pow(protectTolerance, protectFalloff));
+      limitResult = limitResult * (1 + protectResult * protectEffect);
+    }
+
+    despilled[_clr] = std::min(despilled[_clr], limitResult * limit);
+
+    Vec3d rgbDespilled = HueRotate(despilled, -hueShift);
+    return {rgbDespilled.x, rgbDespilled.y, rgbDespilled.z, protectResult};
+  }
+
+  inline double GetLuma(const Vec3d &rgb, int math)
+  {
+    switch(math) {
+      case Constants::LUMA_CCIR601:
+        return rgb.x * 0.299 + rgb.y * 0.587 + rgb.z * 0.114;
+      case Constants::LUMA_REC2020:
+        return rgb.x * 0.2627 + rgb.y * 0.6780 + rgb.z * 0.0593;
+      case Constants::LUMA_AVERAGE:
+        return (rgb.x + rgb.y + rgb.z) / 3.0;
+      case Constants::LUMA_MAX:
+        return std::max({rgb.x, rgb.y, rgb.z});
+      default:
+        return rgb.x * 0.2126 + rgb.y * 0.7152 + rgb.z * 0.0722;
+    }
+  }
+
+  inline double LumaRange(double spillLuma, double blackPoint = 0.0, double whitePoint = 1.0)
+  {
+    if(blackPoint <= 0.0 && whitePoint >= 1.0) return spillLuma;
+
+    double range = whitePoint - blackPoint;
+    if(range <= 0.0) return spillLuma;
+
+    return Clamp((spillLuma - blackPoint) / range, 0.0, 1.0);
+  }
+
+  // the whole per pixel path of ProcessCPU, same knob struct layout as
+  // color::PixelParams with the despill color driven hue shift folded in
+  struct PixelParams {
+    int clr;
+    int despillMath;
+    double customWeight;
+    bool protectTones;
+    bool protectPreview;
+    Vec3d protectColor;
+    double protectTolerance;
+    double protectEffect;
+    double protectFalloff;
+    bool absMode;
+    int respillMath;
+    double blackPoint;
+    double whitePoint;
+    int outputType;
+    bool outputAlpha;
+    bool invertAlpha;
+  };
+
+  inline bool DespillPixel(const PixelParams &p, const Vec3d &rgb, const Vec3d &despillColor,
+                           double hueShift, double limit, const Vec3d &respill,
+                           double inputAlpha, Vec3d &out, double &outAlpha)
+  {
+    Vec4d raw = Despill(rgb, hueShift, p.clr, p.despillMath, limit, p.customWeight,
+                        p.protectTones, p.protectColor, p.protectTolerance, p.protectEffect,
+                        p.protectFalloff);
+
+    if(p.protectPreview && p.protectTones) {
+      out = rgb * Clamp(raw.w * p.protectEffect, 0.0, 1.0);
+      return false;
+    }
+
+    Vec3d spillVec = rgb - Vec3d(raw.x, raw.y, raw.z);
+    double spillLuma = GetLuma(spillVec, p.respillMath);
+
+    Vec3d despilledRGB;
+    Vec3d spillFull;
+    double spillLumaFull;
+
+    if(!p.absMode) {
+      despilledRGB = Vec3d(raw.x, raw.y, raw.z);
+      spillFull = spillVec;
+      spillLumaFull = spillLuma;
+    }
+    else {
+      Vec4d pick = Despill(despillColor, hueShift, p.clr, p.despillMath, limit, p.customWeight,
+                           p.protectTones, p.protectColor, p.protectTolerance, p.protectEffect,
+                           p.protectFalloff);
+      double pickSpillLuma = GetLuma(despillColor - Vec3d(pick.x, pick.y, pick.z), p.respillMath);
+
+      spillLumaFull = pickSpillLuma == 0.0 ? 0.0 : spillLuma / pickSpillLuma;
+      spillFull = despillColor * spillLumaFull;
+      despilledRGB = rgb - spillFull;
+    }
+
+    if(p.outputType == Constants::OUTPUT_DESPILL) {
+      double rangeLuma = LumaRange(spillLumaFull, p.blackPoint, p.whitePoint);
+      out = despilledRGB + respill * rangeLuma;
+      spillLumaFull = rangeLuma;
+    }
+    else {
+      out = spillFull;
+    }
+
+    if(!p.outputAlpha) {
+      outAlpha = inputAlpha;
+    }
+    else if(!p.invertAlpha) {
+      outAlpha = spillLumaFull;
+    }
+    else {
+      outAlpha = 1.0 - spillLumaFull;
+    }
+    return true;
+  }
+
+  // hue shift of a despill color, as ProcessCPU derives it from the Color input
+  inline double HueShiftFromColor(const Vec3d &despillColor, double hueOffset)
+  {
+    double autoShift = ColorAngle(VectorToPlane(despillColor), VectorToPlane(Vec3d(1.0, 0.0, 0.0)));
+    return hueOffset - autoShift * 180.0 / kPi;
+  }
+}  // namespace reference
+
+#endif  // REFERENCE_H
@@ -0,0 +1,40 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <cstddef>
+
+namespace scan
+{
+  // pixels tested per step, sized so the inner compare folds into one vector op
+  static const int kBlockSize = 8;
+
+  // returns the first index in [start, end) where (values[i * stride] == value)
+  // differs from match, or end if the whole range is a run
+  inline int FindRunEnd(const float *values, ptrdiff_t stride, int start, int end, float value,
+                        bool match)
+  {
+    const int full = match ? kBlockSize : 0;
+    int i = start;
+
+    // block test: count matches without branching, stop at the first mixed block
+    for(; i + kBlockSize <= end; i += kBlockSize) {
+      int hits = 0;
+      for(int j = 0; j < kBlockSize; ++j) {
+        hits += values[(i + j) * stride] == value ? 1 : 0;
+      }
+      if(hits != full) {
+        break;
+      }
+    }
+
+    // scalar tail, also locates the exact end inside a mixed block
+    for(; i < end; ++i) {
+      if((values[i * stride] == value) != match) {
+        break;
+      }
+    }
+    return i;
+  }
+}  // namespace scan
+
+#endif  // SCAN_H
@@ -0,0 +1,110 @@
+#ifndef SPILL_CACHE_H
+#define SPILL_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace spillcache
+{
+  // spill estimates of one frame on disk: a header, then square tiles of kTileSize
+  // pixels in rows from the bottom left, each holding the spill r, g, b and luma
+  // planes of the tile. edge tiles are stored full size. a row of tiles is written
+  // once its rows are in, the file takes its name once every row of the frame is,
+  // and is read back through mmap
+  static const int kTileSize = 64;
+  static const int kChannels = 4;
+
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t tileSize;
+    int32_t x, y, width, height;
+    uint64_t key;
+  };
+
+  // cache file name of key in directory
+  std::string CachePath(const std::string &directory, uint64_t key);
+
+  class Reader
+  {
+   public:
+    Reader() = default;
+    ~Reader();
+    Reader(const Reader &) = delete;
+    Reader &operator=(const Reader &) = delete;
+
+    // maps the file at path when it holds key for the box (x, y, width, height), and
+    // marks it used for the size cap of the Writer
+    bool Open(const std::string &path, uint64_t key, int x, int y, int width, int height);
+    void Close();
+    bool IsOpen() const { return _data != nullptr; }
+
+    // copies the estimates of pixels [x, r) of row y to the four channel rows,
+    // indexed from x. pixels outside the box repeat the edge
+    void ReadRow(int y, int x, int r, float *const channel[kChannels]) const;
+
+   private:
+    const unsigned char *_data = nullptr;
+    size_t _size = 0;
+    Header _header = {};
+    int _tilesX = 0;
+#if defined(_WIN32)
+    void *_file = nullptr;
+    void *_mapping = nullptr;
+#endif
+  };
+
+  class Writer
+  {
+   public:
+    Writer() = default;
+    ~Writer();
+    Writer(const Writer &) = delete;
+    Writer &operator=(const Writer &) = delete;
+
+    // starts collecting the rows of the box in a file next to path, renamed to path
+    // once they are all in. the cache files of the directory are then trimmed to
+    // capBytes, least recently used first, 0 keeps them all. an empty path stops
+    // collecting
+    void Reset(const std::string &path, uint64_t key, int x, int y, int width, int height,
+               uint64_t capBytes);
+    bool IsActive() const { return !_path.empty(); }
+
+    // stores row y of the box, the channel rows are indexed from the box x. safe to
+    // call from several threads
+    void AddRow(int y, const float *const channel[kChannels]);
+
+   private:
+    // tiles of one row of tiles, until its rows are in
+    struct Band {
+      int rows = 0;
+      std::vector<float> tiles;
+    };
+    bool WriteBand(int band, const std::vector<float> &tiles);
+    bool Finish();
+    void Discard();
+
+    std::mutex _lock;  // rows and bands
+    std::string _path;
+    Header _header = {};
+    uint64_t _cap = 0;
+    int _tilesX = 0;
+    int _bandCount = 0;
+    int _rowsDone = 0;
+    std::vector<char> _rowDone;
+    std::map<int, Band> _bands;
+
+    std::mutex _fileLock;  // temporary file, bands are written outside _lock
+    std::string _target, _temp;
+    std::FILE *_file = nullptr;
+    int _bandsWritten = 0;
+    bool _failed = false;
+  };
+}  // namespace spillcache
+
+#endif  // SPILL_CACHE_H
@@ -0,0 +1,65 @@
+#ifndef VECTOR_H
+#define VECTOR_H
+
+#include <cmath>
+
+// small vector types for the despill math. they follow the DD::Image::Vector3 and
+// Vector4 interface used by Color.h, so the math builds without the NDK and gives
+// the same numbers in the plugin and in the core library
+namespace color
+{
+  // a < b ? a : b, same NaN behaviour as the NDK MIN and MAX
+  template <class T>
+  inline T Min(T a, T b)
+  {
+    return a < b ? a : b;
+  }
+
+  template <class T>
+  inline T Max(T a, T b)
+  {
+    return a > b ? a : b;
+  }
+
+  inline float Clamp(float v, float lo, float hi)
+  {
+    return v < lo ? lo : (v > hi ? hi : v);
+  }
+
+  class Vector3
+  {
+   public:
+    float x, y, z;
+
+    Vector3() : x(0.0f), y(0.0f), z(0.0f) {}
+    Vector3(float x_, float y_, float z_) : x(x_), y(y_), z(z_) {}
+    explicit Vector3(const float *v) : x(v[0]), y(v[1]), z(v[2]) {}
+
+    float &operator[](int i) { return (&x)[i]; }
+    const float &operator[](int i) const { return (&x)[i]; }
+
+    Vector3 operator+(const Vector3 &v) const { return Vector3(x + v.x, y + v.y, z + v.z); }
+    Vector3 operator-(const Vector3 &v) const { return Vector3(x - v.x, y - v.y, z - v.z); }
+    Vector3 operator*(float s) const { return Vector3(x * s, y * s, z * s); }
+
+    float dot(const Vector3 &v) const { return x * v.x + y * v.y + z * v.z; }
+    Vector3 cross(const Vector3 &v) const
+    {
+      return Vector3(y * v.z - z * v.y, z * v.x - x * v.z, x * v.y - y * v.x);
+    }
+  };
+
+  class Vector4
+  {
+   public:
+    float x, y, z, w;
+
+    Vector4() : x(0.0f), y(0.0f), z(0.0f), w(0.0f) {}
+    Vector4(float x_, float y_, float z_, float w_) : x(x_), y(y_), z(z_), w(w_) {}
+
+    float &operator[](int i) { return (&x)[i]; }
+    const float &operator[](int i) const { return (&x)[i]; }
+  };
+}  // namespace color
+
+#endif  // VECTOR_H
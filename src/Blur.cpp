@@ -0,0 +1,330 @@
+
+#include "include/Blur.h"
+
+#include <cmath>
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+#include "include/Constants.h"
+
+namespace blur
+{
+  namespace
+  {
+    inline int ClampIndex(int i, int n)
+    {
+      return i < 0 ? 0 : (i >= n ? n - 1 : i);
+    }
+
+    // running-sum box of the rows: a window of 2 * whole + 1 taps, plus the two
+    // outer taps weighted by the fractional part of the radius
+    void BoxRows(float *plane, int width, float radius, int y0, int y1)
+    {
+      const int whole = static_cast<int>(radius);
+      const float frac = radius - whole;
+      const double norm = 1.0 / (2.0 * radius + 1.0);
+      std::vector<float> line(width);
+
+      for(int y = y0; y < y1; ++y) {
+        float *row = plane + static_cast<ptrdiff_t>(y) * width;
+        line.assign(row, row + width);
+
+        double sum = 0.0;
+        for(int k = -whole; k <= whole; ++k) {
+          sum += line[ClampIndex(k, width)];
+        }
+        for(int x = 0; x < width; ++x) {
+          float entering = line[ClampIndex(x + whole + 1, width)];
+          float outer = line[ClampIndex(x - whole - 1, width)] + entering;
+          row[x] = static_cast<float>((sum + frac * outer) * norm);
+          sum += entering - line[ClampIndex(x - whole, width)];
+        }
+      }
+    }
+
+    // same box down the columns [x0, x1), one running sum per column so the plane is
+    // walked row by row
+    void BoxColumns(float *plane, int width, int height, float radius, int x0, int x1)
+    {
+      const int whole = static_cast<int>(radius);
+      const float frac = radius - whole;
+      const double norm = 1.0 / (2.0 * radius + 1.0);
+      const int columns = x1 - x0;
+      std::vector<float> source(static_cast<ptrdiff_t>(columns) * height);
+      for(int y = 0; y < height; ++y) {
+        const float *row = plane + static_cast<ptrdiff_t>(y) * width + x0;
+        std::copy(row, row + columns, source.begin() + static_cast<ptrdiff_t>(y) * columns);
+      }
+      std::vector<double> sum(columns, 0.0);
+
+      auto rowAt = [&](int y) -> const float * {
+        return source.data() + static_cast<ptrdiff_t>(ClampIndex(y, height)) * columns;
+      };
+
+      for(int k = -whole; k <= whole; ++k) {
+        const float *in = rowAt(k);
+        for(int x = 0; x < columns; ++x) {
+          sum[x] += in[x];
+        }
+      }
+      for(int y = 0; y < height; ++y) {
+        float *row = plane + static_cast<ptrdiff_t>(y) * width + x0;
+        const float *above = rowAt(y - whole - 1);
+        const float *below = rowAt(y + whole + 1);
+        const float *leaving = rowAt(y - whole);
+        for(int x = 0; x < columns; ++x) {
+          row[x] = static_cast<float>((sum[x] + frac * (above[x] + below[x])) * norm);
+          sum[x] += below[x] - leaving[x];
+        }
+      }
+    }
+
+    // Young - van Vliet coefficients for q, normalized so a constant signal is
+    // unchanged. the gain is taken in closed form, 1 - (a1 + a2 + a3) cancels badly
+    // at large q
+    struct Recursive {
+      double B, a1, a2, a3;
+    };
+
+    Recursive MakeRecursive(double q)
+    {
+      double q2 = q * q;
+      double q3 = q2 * q;
+      double b0 = 1.57825 + 2.44413 * q + 1.4281 * q2 + 0.422205 * q3;
+      Recursive c;
+      c.a1 = (2.44413 * q + 2.85619 * q2 + 1.26661 * q3) / b0;
+      c.a2 = -(1.4281 * q2 + 1.26661 * q3) / b0;
+      c.a3 = 0.422205 * q3 / b0;
+      c.B = (1.57825 + 0.00001 * q2) / b0;
+      return c;
+    }
+
+    // variance of the causal and anti-causal pair, from the derivatives at 1 of the
+    // generating function B / (1 - a1 t - a2 t^2 - a3 t^3) of one pass
+    double PairVariance(const Recursive &c)
+    {
+      double d1 = c.a1 + 2.0 * c.a2 + 3.0 * c.a3;
+      double d2 = 2.0 * c.a2 + 6.0 * c.a3;
+      double mean = d1 / c.B;
+      double second = d2 / c.B + 2.0 * d1 * d1 / (c.B * c.B);
+      return 2.0 * (second + mean - mean * mean);
+    }
+
+    // the published q(sigma) fit is off by up to 10% of sigma, q is solved instead so
+    // the pair has the variance of sigma
+    Recursive SolveRecursive(double sigma)
+    {
+      double lo = 0.0, hi = 2.0 * sigma + 2.0;
+      for(int i = 0; i < 60; ++i) {
+        double mid = 0.5 * (lo + hi);
+        (PairVariance(MakeRecursive(mid)) < sigma * sigma ? lo : hi) = mid;
+      }
+      return MakeRecursive(0.5 * (lo + hi));
+    }
+
+    // causal then anti-causal pass over each row. the state before the first sample
+    // is the first sample itself, the steady state of a repeated edge
+    void RecursiveRows(float *plane, int width, const Recursive &c, int y0, int y1)
+    {
+      std::vector<double> line(width);
+      for(int y = y0; y < y1; ++y) {
+        float *row = plane + static_cast<ptrdiff_t>(y) * width;
+        double w1 = row[0], w2 = row[0], w3 = row[0];
+        for(int x = 0; x < width; ++x) {
+          double w = c.B * row[x] + c.a1 * w1 + c.a2 * w2 + c.a3 * w3;
+          w3 = w2;
+          w2 = w1;
+          w1 = w;
+          line[x] = w;
+        }
+        w1 = w2 = w3 = line[width - 1];
+        for(int x = width - 1; x >= 0; --x) {
+          double w = c.B * line[x] + c.a1 * w1 + c.a2 * w2 + c.a3 * w3;
+          w3 = w2;
+          w2 = w1;
+          w1 = w;
+          row[x] = static_cast<float>(w);
+        }
+      }
+    }
+
+    // same passes down the columns [x0, x1), walked row by row. the filter state is
+    // kept in double rows, at large sigma the gain B is small enough for float state
+    // to drift
+    void RecursiveColumns(float *plane, int width, int height, const Recursive &c, int x0,
+                          int x1)
+    {
+      const int columns = x1 - x0;
+      std::vector<double> state(3 * static_cast<ptrdiff_t>(columns));
+      double *w1 = state.data(), *w2 = w1 + columns, *w3 = w2 + columns;
+
+      // one pass from the edge row at y0 in the direction step, the oldest state row
+      // is overwritten with the new one
+      auto pass = [&](int y0, int step) {
+        const float *edge = plane + static_cast<ptrdiff_t>(y0) * width + x0;
+        std::copy(edge, edge + columns, w1);
+        std::copy(edge, edge + columns, w2);
+        std::copy(edge, edge + columns, w3);
+        for(int i = 0, y = y0; i < height; ++i, y += step) {
+          float *row = plane + static_cast<ptrdiff_t>(y) * width + x0;
+          std::swap(w3, w2);
+          std::swap(w2, w1);
+          for(int x = 0; x < columns; ++x) {
+            double w = c.B * row[x] + c.a1 * w2[x] + c.a2 * w3[x] + c.a3 * w1[x];
+            w1[x] = w;
+            row[x] = static_cast<float>(w);
+          }
+        }
+      };
+
+      pass(0, 1);
+      pass(height - 1, -1);
+    }
+
+    // sigma of a box 2 * radius + 1 wide, the recursive filter holds for sigma >= 0.5
+    bool UseRecursive(int filter, float radius, double &sigma)
+    {
+      sigma = std::sqrt(radius * (radius + 1.0) / 3.0);
+      return filter == Constants::BLUR_GAUSSIAN && sigma >= 0.5;
+    }
+
+    bool Blurs(int filter, float radius, int width, int height)
+    {
+      return filter != Constants::BLUR_NONE && radius > 0.0f && width > 0 && height > 0;
+    }
+  }  // namespace
+
+  void BlurRows(float *plane, int width, int height, int filter, float radius, int y0, int y1)
+  {
+    y0 = std::max(y0, 0);
+    y1 = std::min(y1, height);
+    if(!Blurs(filter, radius, width, height) || y0 >= y1) {
+      return;
+    }
+
+    double sigma;
+    if(UseRecursive(filter, radius, sigma)) {
+      RecursiveRows(plane, width, SolveRecursive(sigma), y0, y1);
+      return;
+    }
+    BoxRows(plane, width, radius, y0, y1);
+  }
+
+  void BlurColumns(float *plane, int width, int height, int filter, float radius, int x0, int x1)
+  {
+    x0 = std::max(x0, 0);
+    x1 = std::min(x1, width);
+    if(!Blurs(filter, radius, width, height) || x0 >= x1) {
+      return;
+    }
+
+    double sigma;
+    if(UseRecursive(filter, radius, sigma)) {
+      RecursiveColumns(plane, width, height, SolveRecursive(sigma), x0, x1);
+      return;
+    }
+    BoxColumns(plane, width, height, radius, x0, x1);
+  }
+
+  void BlurPlane(float *plane, int width, int height, int filter, float radius)
+  {
+    BlurRows(plane, width, height, filter, radius, 0, height);
+    BlurColumns(plane, width, height, filter, radius, 0, width);
+  }
+
+  int BlurReach(int filter, float radius)
+  {
+    if(!Blurs(filter, radius, 1, 1)) {
+      return 0;
+    }
+    double sigma;
+    if(UseRecursive(filter, radius, sigma)) {
+      return static_cast<int>(std::ceil(5.0 * sigma));
+    }
+    return static_cast<int>(radius) + 1;
+  }
+
+  bool BoxFilter(int filter, float radius)
+  {
+    double sigma;
+    return Blurs(filter, radius, 1, 1) && !UseRecursive(filter, radius, sigma);
+  }
+
+  BoxWindow::BoxWindow() : _width(0), _channels(0), _radius(0.0f), _y0(0), _y1(0), _row(-1)
+  {
+  }
+
+  void BoxWindow::Reset(int width, int channels, float radius, int y0, int y1)
+  {
+    _width = width;
+    _channels = channels;
+    _radius = radius;
+    _y0 = y0;
+    _y1 = y1;
+    _row = y0 - 1;
+    const size_t size = static_cast<size_t>(std::max(width, 0)) * std::max(channels, 0);
+    _sum.assign(size, 0.0);
+    _above.assign(size, 0.0f);
+    _below.assign(size, 0.0f);
+    _line.assign(size, 0.0f);
+  }
+
+  bool BoxWindow::Fill(int y, const RowSource &source, float *row)
+  {
+    if(!source(_y0 + ClampIndex(y - _y0, _y1 - _y0), row)) {
+      return false;
+    }
+    BoxRows(row, _width, _radius, 0, _channels);
+    return true;
+  }
+
+  bool BoxWindow::Blur(int y, const RowSource &source, float *out)
+  {
+    const int whole = static_cast<int>(_radius);
+    const float frac = _radius - whole;
+    const double norm = 1.0 / (2.0 * _radius + 1.0);
+    const size_t size = _sum.size();
+
+    // a fill reads 2 * whole + 3 rows, a move down two rows a step
+    if(_row < _y0 || y < _row || y - _row > whole + 1) {
+      _row = _y0 - 1;
+      std::fill(_sum.begin(), _sum.end(), 0.0);
+      for(int k = y - whole; k <= y + whole; ++k) {
+        if(!Fill(k, source, _line.data())) {
+          return false;
+        }
+        for(size_t i = 0; i < size; ++i) {
+          _sum[i] += _line[i];
+        }
+      }
+      if(!Fill(y - whole - 1, source, _above.data()) ||
+         !Fill(y + whole + 1, source, _below.data())) {
+        return false;
+      }
+      _row = y;
+    }
+
+    // the row leaving the window is the outer tap above the next row, the outer tap
+    // below enters it
+    while(_row < y) {
+      if(!Fill(_row - whole, source, _above.data())) {
+        _row = _y0 - 1;
+        return false;
+      }
+      for(size_t i = 0; i < size; ++i) {
+        _sum[i] += _below[i] - _above[i];
+      }
+      ++_row;
+      if(!Fill(_row + whole + 1, source, _below.data())) {
+        _row = _y0 - 1;
+        return false;
+      }
+    }
+
+    for(size_t i = 0; i < size; ++i) {
+      out[i] = static_cast<float>((_sum[i] + frac * (_above[i] + _below[i])) * norm);
+    }
+    return true;
+  }
+}  // namespace blur
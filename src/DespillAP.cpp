@@ -1,16 +1,62 @@
 
 #include "include/DespillAP.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <string>
+#include <system_error>
+
+#include "include/Blur.h"
 #include "include/Color.h"
 #include "include/Constants.h"
+#include "include/Scan.h"
 
 enum inputs {
   inputSource = 0,
   inputLimit = 1,
   inputColor = 2,
   inputRespill = 3,
+  inputId = 4,
+};
+
+// knob names of the id plans
+struct IdPlanNames {
+  const char *group, *label, *enable, *id, *pick, *math, *offset, *limit, *protect,
+      *protectColor, *protectTolerance;
+};
+
+static const IdPlanNames ID_PLAN_NAMES[Constants::ID_PLANS] = {
+    {"id_plan1", "plan 1", "id_plan1_enable", "id_plan1_id", "id_plan1_pick", "id_plan1_math",
+     "id_plan1_offset", "id_plan1_limit", "id_plan1_protect", "id_plan1_protect_color",
+     "id_plan1_protect_tolerance"},
+    {"id_plan2", "plan 2", "id_plan2_enable", "id_plan2_id", "id_plan2_pick", "id_plan2_math",
+     "id_plan2_offset", "id_plan2_limit", "id_plan2_protect", "id_plan2_protect_color",
+     "id_plan2_protect_tolerance"},
+    {"id_plan3", "plan 3", "id_plan3_enable", "id_plan3_id", "id_plan3_pick", "id_plan3_math",
+     "id_plan3_offset", "id_plan3_limit", "id_plan3_protect", "id_plan3_protect_color",
+     "id_plan3_protect_tolerance"},
+    {"id_plan4", "plan 4", "id_plan4_enable", "id_plan4_id", "id_plan4_pick", "id_plan4_math",
+     "id_plan4_offset", "id_plan4_limit", "id_plan4_protect", "id_plan4_protect_color",
+     "id_plan4_protect_tolerance"},
+};
+
+// knob names of the spill points
+struct SpillPointNames {
+  const char *enable, *position, *color;
 };
 
+static const SpillPointNames SPILL_POINT_NAMES[Constants::SPILL_POINTS] = {
+    {"spill_point1_enable", "spill_point1_position", "spill_point1_color"},
+    {"spill_point2_enable", "spill_point2_position", "spill_point2_color"},
+    {"spill_point3_enable", "spill_point3_position", "spill_point3_color"},
+    {"spill_point4_enable", "spill_point4_position", "spill_point4_color"},
+    {"spill_point5_enable", "spill_point5_position", "spill_point5_color"},
+    {"spill_point6_enable", "spill_point6_position", "spill_point6_color"},
+};
+
+static_assert(Constants::SPILL_POINTS <= DESPILL_MAX_POINTS, "too many spill points");
+
 DespillAPIop::DespillAPIop(Node *node) : Iop(node)
 {
   inputs(3);
@@ -32,6 +78,8 @@ DespillAPIop::DespillAPIop(Node *node) : Iop(node)
   k_hueOffset = 0.0f;
   k_hueLimit = 1.0f;
   k_respillMath = 0;
+  k_respillBlur = Constants::BLUR_NONE;
+  k_respillBlurSize = 20.0f;
   k_protectColor[0] = 0.0f;
   k_protectColor[1] = 0.0f;
   k_protectColor[2] = 0.0f;
@@ -41,21 +89,84 @@ DespillAPIop::DespillAPIop(Node *node) : Iop(node)
   k_invertLimitMask = 1;
   k_blackPoint = 0.0f;
   k_whitePoint = 1.0f;
+  k_spillCache = false;
+  k_spillCacheDir = "";
+  k_spillCacheSize = 4096;
+  k_prefetchDepth = 0;
+  k_prefetchWait = 0.0f;
+
+  k_wedgeMode = Constants::WEDGE_OFF;
+  k_wedgeCount = 8;
+  k_wedgeOffset[0] = -10.0f;
+  k_wedgeOffset[1] = 10.0f;
+  k_wedgeLimit[0] = 1.0f;
+  k_wedgeLimit[1] = 1.0f;
+  k_wedgeTolerance[0] = 0.2f;
+  k_wedgeTolerance[1] = 0.2f;
+  k_wedgeMath = false;
+
+  for(int i = 0; i < Constants::SPILL_POINTS; i++) {
+    SpillPointKnobs &point = k_spillPoints[i];
+    point.enable = false;
+    point.position[0] = 0.0f;
+    point.position[1] = 0.0f;
+    point.color[0] = 0.0f;
+    point.color[1] = 1.0f;
+    point.color[2] = 0.0f;
+  }
+
+  k_idChannel = Chan_Red;
+  for(int i = 0; i < Constants::ID_PLANS; i++) {
+    IdPlanKnobs &plan = k_idPlans[i];
+    plan.enable = false;
+    plan.id = i + 1;
+    plan.pick[0] = 0.0f;
+    plan.pick[1] = 1.0f;
+    plan.pick[2] = 0.0f;
+    plan.despillMath = Constants::DESPILL_AVERAGE;
+    plan.hueOffset = 0.0f;
+    plan.hueLimit = 1.0f;
+    plan.protectTones = false;
+    for(int c = 0; c < 3; c++) {
+      plan.protectColor[c] = 0.0f;
+    }
+    plan.protectTolerance = 0.2f;
+  }
 
   isSourceConnected = false;
   isLimitConnected = false;
   isColorConnected = false;
   isRespillConnected = false;
+  isIdConnected = false;
+
+  k_protectTones = 0;
+  k_protectPrev = 0;
+
+  _params = despill::DefaultParams();
+  _sheetColumns = 1;
+  _limitEdgeZero[0] = _limitEdgeZero[1] = -1;
+  _blurKey = 0;
+  _blurBuild = nullptr;
+  _blurColumns = false;
+  _prefetchDepth = 0;
+  _requestX = _requestY = _requestR = _requestT = 0;
+  _prefetchRunning = 0;
+  _prefetchStop = false;
+  _fetchWaitUs = 0;
+  _prefetchWaitUs = 0;
+}
 
-  _returnColor = 0;
+DespillAPIop::~DespillAPIop()
+{
+  StopPrefetch();
 }
 
 void DespillAPIop::knobs(Knob_Callback f)
 {
   Enumeration_knob(f, &k_colorType, Constants::COLOR_TYPES, "color");
   Tooltip(f,
-          "Select spill color: Red, Green, Blue channels, or use Color Picker. Disabled when Color "
-          "input is connected");
+          "Select spill color: Red, Green, Blue channels, use Color Picker, or interpolate the "
+          "spill points across the frame. Disabled when Color input is connected");
 
   ClearFlags(f, Knob::STARTLINE);
   Bool_knob(f, &k_absMode, "absolute_mode", "Absolute Mode");
@@ -65,15 +176,40 @@ void DespillAPIop::knobs(Knob_Callback f)
 
   Knob *pick_knob = Color_knob(f, k_spillPick, "pick");
   ClearFlags(f, Knob::MAGNITUDE | Knob::SLIDER);
+  SetFlags(f, Knob::NO_RERENDER);
   Tooltip(f,
           "Pick specific spill color. Automatically calculates hue shift from red reference. "
           "Disabled when Color input connected or when using channel buttons");
 
+  BeginGroup(f, "spill_points", "spill points");
+  SetFlags(f, Knob::CLOSED);
+  for(int i = 0; i < Constants::SPILL_POINTS; i++) {
+    const SpillPointNames &names = SPILL_POINT_NAMES[i];
+    SpillPointKnobs &point = k_spillPoints[i];
+
+    Bool_knob(f, &point.enable, names.enable, "enable");
+    SetFlags(f, Knob::NO_RERENDER | Knob::STARTLINE);
+    Tooltip(f, "Use this point in the Points color mode");
+
+    XY_knob(f, point.position, names.position, "position");
+    ClearFlags(f, Knob::STARTLINE);
+    SetFlags(f, Knob::NO_RERENDER);
+    Tooltip(f, "Screen position where the spill color was sampled");
+
+    Color_knob(f, point.color, names.color, "color");
+    ClearFlags(f, Knob::MAGNITUDE | Knob::SLIDER | Knob::STARTLINE);
+    SetFlags(f, Knob::NO_RERENDER);
+    Tooltip(f,
+            "Spill color at the point. The hue shift is interpolated smoothly between the "
+            "enabled points");
+  }
+  EndGroup(f);
+
   Enumeration_knob(f, &k_despillMath, Constants::DESPILL_MATH_TYPES, "despill_math", "math");
   Tooltip(f, "Algorithm for despill calculation. Custom math enables the weight parameter below");
 
   Float_knob(f, &k_customWeight, IRange(-1, 1), "custom_weight", "");
-  SetFlags(f, Knob::DISABLED);
+  SetFlags(f, Knob::DISABLED | Knob::NO_RERENDER);
   Tooltip(f, "Custom weight for despill calculation. Only active when Math is set to Custom");
 
   Divider(f, "<b>Hue</b>");
@@ -89,19 +225,20 @@ void DespillAPIop::knobs(Knob_Callback f)
           "aggressive the despill can be");
 
   Input_Channel_knob(f, &k_limitChannel, 1, 1, "limit_channel", "mask");
+  SetFlags(f, Knob::NO_RERENDER);
   Tooltip(f,
           "Channel from Limit input to control despill strength per pixel. White = full strength, "
           "black = no despill");
 
   Bool_knob(f, &k_invertLimitMask, "invert_limit_mask", "invert");
-  SetFlags(f, Knob::ENDLINE);
+  SetFlags(f, Knob::ENDLINE | Knob::NO_RERENDER);
   Tooltip(f, "Invert limit mask values. Black areas get despill instead of white areas");
 
   Bool_knob(f, &k_protectTones, "protect_tones", "Protect Tones");
   Tooltip(f, "Enable protection of specific colors (like skin tones) from being despilled");
 
   Bool_knob(f, &k_protectPrev, "protect_preview", "Preview");
-  SetFlags(f, Knob::DISABLED);
+  SetFlags(f, Knob::DISABLED | Knob::NO_RERENDER);
   ClearFlags(f, Knob::STARTLINE);
   Tooltip(
       f,
@@ -112,22 +249,22 @@ void DespillAPIop::knobs(Knob_Callback f)
 
   Knob *protectColor_knob = Color_knob(f, k_protectColor, "protect_color", "color");
   ClearFlags(f, Knob::MAGNITUDE | Knob::SLIDER);
-  SetFlags(f, Knob::DISABLED);
+  SetFlags(f, Knob::DISABLED | Knob::NO_RERENDER);
   Tooltip(f,
           "Reference color to protect from despill (typically skin tone or important foreground "
           "color)");
 
   Float_knob(f, &k_protectTolerance, IRange(0, 1), "protect_tolerance", "tolerance");
-  SetFlags(f, Knob::DISABLED);
+  SetFlags(f, Knob::DISABLED | Knob::NO_RERENDER);
   Tooltip(f,
           "Color similarity threshold for protection. Higher values protect more similar colors");
 
   Float_knob(f, &k_protectFalloff, IRange(0, 4), "protect_falloff", "falloff");
-  SetFlags(f, Knob::DISABLED);
+  SetFlags(f, Knob::DISABLED | Knob::NO_RERENDER);
   Tooltip(f, "Softness of protection transition between protected and unprotected areas");
 
   Float_knob(f, &k_protectEffect, IRange(0, 10), "protect_effect", "effect");
-  SetFlags(f, Knob::DISABLED);
+  SetFlags(f, Knob::DISABLED | Knob::NO_RERENDER);
   Tooltip(f,
           "Strength of protection effect. In preview mode, shows as multiplication factor for "
           "protected areas");
@@ -141,14 +278,26 @@ void DespillAPIop::knobs(Knob_Callback f)
 
   Knob *respillColor_knob = Color_knob(f, k_respillColor, IRange(0, 4), "respill_color", "color");
   ClearFlags(f, Knob::MAGNITUDE | Knob::SLIDER);
+  SetFlags(f, Knob::NO_RERENDER);
   Tooltip(
       f,
       "Replacement color added where spill was removed. Multiplied by Respill input if connected");
 
+  Enumeration_knob(f, &k_respillBlur, Constants::BLUR_FILTER_TYPES, "respill_blur", "blur source");
+  Tooltip(f,
+          "Build the respill from a blur of the Source instead of the Respill input, multiplied by "
+          "the respill color. Box and Gaussian cost the same for any size");
+
+  Float_knob(f, &k_respillBlurSize, IRange(0, 200), "respill_blur_size", "");
+  SetFlags(f, Knob::DISABLED | Knob::NO_RERENDER);
+  Tooltip(f, "Blur radius of the Source in pixels");
+
   Float_knob(f, &k_blackPoint, IRange(0, 1), "luma_black", "blackpoint");
+  SetFlags(f, Knob::NO_RERENDER);
   Tooltip(f, "Lower luminance bound. Pixels below this value are fully clipped to 0.");
 
   Float_knob(f, &k_whitePoint, IRange(0, 1), "luma_white", "whitepoint");
+  SetFlags(f, Knob::NO_RERENDER);
   Tooltip(f, "Upper luminance bound. Pixels above this value are fully clipped to 1.");
 
   Divider(f, "<b>Output</b>");
@@ -162,7 +311,7 @@ void DespillAPIop::knobs(Knob_Callback f)
       f, "Generate alpha channel from spill amount. When off, passes through original input alpha");
 
   Bool_knob(f, &k_invertAlpha, "invert_alpha", "Invert");
-  SetFlags(f, Knob::ENDLINE);
+  SetFlags(f, Knob::ENDLINE | Knob::NO_RERENDER);
   Tooltip(f, "Invert spill alpha: spill areas become transparent (0) instead of opaque (1)");
 
   Input_Channel_knob(f, &k_outputSpillChannel, 1, 1, "output_spill_channel", "channel");
@@ -170,24 +319,181 @@ void DespillAPIop::knobs(Knob_Callback f)
   Tooltip(f,
           "Target channel for spill alpha output. Written as clamped values between 0.0 and 1.0");
 
+  Divider(f, "<b>ID Plans</b>");
+
+  Input_Channel_knob(f, &k_idChannel, 1, inputId, "id_channel", "id channel");
+  SetFlags(f, Knob::NO_RERENDER);
+  Tooltip(f,
+          "Channel of the ID input holding an integer object ID or Cryptomatte rank. Pixels "
+          "whose rounded ID matches an enabled plan use its settings, the rest use the knobs "
+          "above");
+
+  for(int i = 0; i < Constants::ID_PLANS; i++) {
+    const IdPlanNames &names = ID_PLAN_NAMES[i];
+    IdPlanKnobs &plan = k_idPlans[i];
+
+    BeginGroup(f, names.group, names.label);
+    SetFlags(f, Knob::CLOSED);
+
+    Bool_knob(f, &plan.enable, names.enable, "enable");
+    SetFlags(f, Knob::NO_RERENDER);
+    Tooltip(f, "Use this plan for the pixels of its ID");
+
+    Int_knob(f, &plan.id, names.id, "id");
+    ClearFlags(f, Knob::STARTLINE);
+    SetFlags(f, Knob::NO_RERENDER);
+    Tooltip(f, "Object ID of the plan");
+
+    Color_knob(f, plan.pick, names.pick, "color");
+    ClearFlags(f, Knob::MAGNITUDE | Knob::SLIDER);
+    SetFlags(f, Knob::NO_RERENDER);
+    Tooltip(f, "Spill color of the object, replaces the color selection and the Color input");
+
+    Enumeration_knob(f, &plan.despillMath, Constants::DESPILL_MATH_TYPES, names.math, "math");
+    SetFlags(f, Knob::NO_RERENDER);
+    Tooltip(f, "Despill math of the object. Custom uses the main custom weight");
+
+    Float_knob(f, &plan.hueOffset, IRange(-30, 30), names.offset, "offset");
+    SetFlags(f, Knob::NO_RERENDER);
+    Tooltip(f, "Hue offset of the object in degrees");
+
+    Float_knob(f, &plan.hueLimit, IRange(0, 2), names.limit, "limit");
+    SetFlags(f, Knob::NO_RERENDER);
+    Tooltip(f, "Despill strength of the object, multiplied by the limit mask if connected");
+
+    Bool_knob(f, &plan.protectTones, names.protect, "Protect Tones");
+    SetFlags(f, Knob::NO_RERENDER);
+    Tooltip(f, "Protect a tone of the object, falloff and effect follow the main knobs");
+
+    Color_knob(f, plan.protectColor, names.protectColor, "protect color");
+    ClearFlags(f, Knob::MAGNITUDE | Knob::SLIDER);
+    SetFlags(f, Knob::NO_RERENDER);
+    Tooltip(f, "Reference color to protect in the object");
+
+    Float_knob(f, &plan.protectTolerance, IRange(0, 1), names.protectTolerance, "tolerance");
+    SetFlags(f, Knob::NO_RERENDER);
+    Tooltip(f, "Color similarity threshold of the protection");
+
+    EndGroup(f);
+  }
+
+  Divider(f, "<b>Wedge</b>");
+
+  Enumeration_knob(f, &k_wedgeMode, Constants::WEDGE_TYPES, "wedge", "wedge");
+  Tooltip(f,
+          "Evaluate variants of the knobs above from a single fetch of the inputs. Layers writes "
+          "each variant to its own wedge1, wedge2... layer, Contact Sheet tiles them over the "
+          "frame from the top left");
+
+  Int_knob(f, &k_wedgeCount, IRange(1, Constants::WEDGE_MAX), "wedge_count", "count");
+  ClearFlags(f, Knob::STARTLINE);
+  SetFlags(f, Knob::DISABLED | Knob::NO_RERENDER);
+  Tooltip(f, "Number of variants");
+
+  MultiFloat_knob(f, k_wedgeOffset, 2, "wedge_offset", "offset");
+  SetFlags(f, Knob::DISABLED | Knob::NO_RERENDER);
+  Tooltip(f, "Hue offset of the first and the last variant, the others are spread evenly");
+
+  MultiFloat_knob(f, k_wedgeLimit, 2, "wedge_limit", "limit");
+  SetFlags(f, Knob::DISABLED | Knob::NO_RERENDER);
+  Tooltip(f, "Hue limit of the first and the last variant");
+
+  MultiFloat_knob(f, k_wedgeTolerance, 2, "wedge_tolerance", "tolerance");
+  SetFlags(f, Knob::DISABLED | Knob::NO_RERENDER);
+  Tooltip(f, "Protect tolerance of the first and the last variant");
+
+  Bool_knob(f, &k_wedgeMath, "wedge_math", "cycle math");
+  SetFlags(f, Knob::DISABLED | Knob::NO_RERENDER);
+  Tooltip(f, "Cycle the variants through Average, Max, Min and Custom instead of the math knob");
+
+  Divider(f, "<b>Performance</b>");
+
+  Bool_knob(f, &k_spillCache, "spill_cache", "disk cache");
+  Tooltip(f,
+          "Keep the spill estimate of each frame in the directory on the right. Once a frame is "
+          "cached, the respill and output knobs are changed without running the despill or "
+          "reading the Color and Limit inputs again. Off while ID plans are in use");
+
+  File_knob(f, &k_spillCacheDir, "spill_cache_dir", "");
+  ClearFlags(f, Knob::STARTLINE);
+  Tooltip(f, "Directory of the spill cache files");
+
+  Int_knob(f, &k_spillCacheSize, IRange(0, 65536), "spill_cache_size", "cache size");
+  SetFlags(f, Knob::NO_RERENDER);
+  Tooltip(f,
+          "Megabytes the spill cache files of the directory may take. Past it the least "
+          "recently used files are deleted as new frames are written. 0 keeps them all");
+
+  Int_knob(f, &k_prefetchDepth, IRange(0, 8), "prefetch", "prefetch rows");
+  SetFlags(f, Knob::NO_RERENDER);
+  Tooltip(f,
+          "Fetch the Color, Respill, Limit and ID rows on worker threads, those of the rendered "
+          "row while its Source row is read and those of this many rows ahead. Helps when the "
+          "inputs hang off heavy branches. 0 fetches them after the Source row");
+
+  Float_knob(f, &k_prefetchWait, "prefetch_wait", "input wait");
+  ClearFlags(f, Knob::STARTLINE);
+  SetFlags(f, Knob::READ_ONLY | Knob::NO_RERENDER | Knob::DO_NOT_WRITE | Knob::NO_ANIMATION);
+  Tooltip(f,
+          "Milliseconds the rows of the last render spent on their input rows after the Source "
+          "row, summed over the render threads. Only measured with prefetch on, shown when the "
+          "panel opens");
+
   Spacer(f, 0);
 }
 
 int DespillAPIop::knob_changed(Knob *k)
 {
   if(k->is("despill_math")) {
-    Knob *despillMath_knob = k->knob("despill_math");
-    Knob *customWeight_knob = k->knob("custom_weight");
+    UpdateSharedKnobs();
+    return 1;
+  }
 
-    if(despillMath_knob->get_value() == 3) {
-      customWeight_knob->enable();
+  for(const IdPlanNames &names : ID_PLAN_NAMES) {
+    if(k->is(names.enable) || k->is(names.math) || k->is(names.protect)) {
+      UpdateSharedKnobs();
+      return 1;
+    }
+  }
+
+  // the wait of the last render, measured on the render threads, is shown here on the
+  // main thread
+  if(k->is("showPanel") || k->is("prefetch")) {
+    knob("prefetch_wait")->set_value(_prefetchWaitUs.load() / 1000.0);
+    return 1;
+  }
+
+  if(k->is("respill_blur")) {
+    if(knob("respill_blur")->get_value() != Constants::BLUR_NONE) {
+      knob("respill_blur_size")->enable();
     }
     else {
-      customWeight_knob->disable();
+      knob("respill_blur_size")->disable();
     }
     return 1;
   }
 
+  if(k->is("wedge")) {
+    bool wedge = knob("wedge")->get_value() != Constants::WEDGE_OFF;
+    const char *names[] = {"wedge_count", "wedge_offset", "wedge_limit", "wedge_tolerance",
+                           "wedge_math"};
+    for(const char *name : names) {
+      if(wedge) {
+        knob(name)->enable();
+      }
+      else {
+        knob(name)->disable();
+      }
+    }
+    UpdateSharedKnobs();
+    return 1;
+  }
+
+  if(k->is("wedge_math")) {
+    UpdateSharedKnobs();
+    return 1;
+  }
+
   if(k->is("color")) {
     if(knob("color")->get_value() != 3) {
       knob("pick")->disable();
@@ -202,30 +508,161 @@ int DespillAPIop::knob_changed(Knob *k)
     Knob *protectTones_knob = k->knob("protect_tones");
     Knob *protectColor_knob = k->knob("protect_color");
     Knob *protectTolerance_knob = k->knob("protect_tolerance");
-    Knob *protectFalloff_knob = k->knob("protect_falloff");
-    Knob *protectEffect_knob = k->knob("protect_effect");
-    Knob *protectPreview_knob = k->knob("protect_preview");
 
     if(protectTones_knob->get_value() == 1) {
       protectColor_knob->enable();
       protectTolerance_knob->enable();
-      protectFalloff_knob->enable();
-      protectEffect_knob->enable();
-      protectPreview_knob->enable();
     }
     else {
       protectColor_knob->disable();
       protectTolerance_knob->disable();
-      protectFalloff_knob->disable();
-      protectEffect_knob->disable();
-      protectPreview_knob->disable();
     }
+    UpdateSharedKnobs();
     return 1;
   }
-  knob("tile_color")->set_value(0x8b8b8bff);  // node color
   return 0;
 }
 
+bool DespillAPIop::CustomWeightInUse() const
+{
+  bool inUse = k_despillMath == Constants::DESPILL_CUSTOM ||
+               (k_wedgeMode != Constants::WEDGE_OFF && k_wedgeMath);
+  if(isIdConnected) {
+    for(const IdPlanKnobs &plan : k_idPlans) {
+      inUse = inUse || (plan.enable && plan.despillMath == Constants::DESPILL_CUSTOM);
+    }
+  }
+  return inUse;
+}
+
+bool DespillAPIop::ProtectShapeInUse() const
+{
+  bool inUse = k_protectTones;
+  if(isIdConnected) {
+    for(const IdPlanKnobs &plan : k_idPlans) {
+      inUse = inUse || (plan.enable && plan.protectTones);
+    }
+  }
+  return inUse;
+}
+
+void DespillAPIop::UpdateSharedKnobs()
+{
+  // the id plans take the custom weight and the protect falloff, effect and preview
+  // of the main knobs, the cycled wedge math the custom weight. these stay enabled
+  // while any of them uses one
+  bool customWeight = CustomWeightInUse();
+  bool protectShape = ProtectShapeInUse();
+  const char *protectNames[] = {"protect_falloff", "protect_effect", "protect_preview"};
+
+  if(customWeight) {
+    knob("custom_weight")->enable();
+  }
+  else {
+    knob("custom_weight")->disable();
+  }
+  for(const char *name : protectNames) {
+    if(protectShape) {
+      knob(name)->enable();
+    }
+    else {
+      knob(name)->disable();
+    }
+  }
+}
+
+void DespillAPIop::append(Hash &hash)
+{
+  // knobs flagged NO_RERENDER are hashed here only while they change the pixels, so
+  // editing a control that is out of use keeps the cached rows
+  if(!isColorConnected && k_colorType == Constants::COLOR_PICK) {
+    for(int i = 0; i < 3; i++) {
+      hash.append(k_spillPick[i]);
+    }
+  }
+  if(!isColorConnected && k_colorType == Constants::COLOR_POINTS) {
+    for(const SpillPointKnobs &point : k_spillPoints) {
+      hash.append(point.enable);
+      if(point.enable) {
+        hash.append(point.position[0]);
+        hash.append(point.position[1]);
+        for(int i = 0; i < 3; i++) {
+          hash.append(point.color[i]);
+        }
+      }
+    }
+  }
+  if(CustomWeightInUse()) {
+    hash.append(k_customWeight);
+  }
+  if(isLimitConnected) {
+    hash.append(static_cast<int>(k_limitChannel));
+    hash.append(k_invertLimitMask);
+  }
+  if(k_protectTones) {
+    for(int i = 0; i < 3; i++) {
+      hash.append(k_protectColor[i]);
+    }
+    hash.append(k_protectTolerance);
+  }
+  if(ProtectShapeInUse()) {
+    hash.append(k_protectPrev);
+    hash.append(k_protectFalloff);
+    hash.append(k_protectEffect);
+  }
+
+  // the Respill input replaces the respill color, the blurred source is tinted by it
+  bool respillBlur = k_respillBlur != Constants::BLUR_NONE;
+  if(respillBlur || !isRespillConnected) {
+    for(int i = 0; i < 3; i++) {
+      hash.append(k_respillColor[i]);
+    }
+  }
+  if(respillBlur) {
+    hash.append(k_respillBlurSize);
+  }
+
+  // the luma range only shapes the respill of the despill output
+  if(k_outputType == Constants::OUTPUT_DESPILL) {
+    hash.append(k_blackPoint);
+    hash.append(k_whitePoint);
+  }
+  if(k_outputAlpha) {
+    hash.append(k_invertAlpha);
+  }
+
+  // id plans only count with the ID input connected, and only the enabled ones
+  if(isIdConnected) {
+    hash.append(static_cast<int>(k_idChannel));
+    for(const IdPlanKnobs &plan : k_idPlans) {
+      hash.append(plan.enable);
+      if(!plan.enable) {
+        continue;
+      }
+      hash.append(plan.id);
+      for(int i = 0; i < 3; i++) {
+        hash.append(plan.pick[i]);
+        hash.append(plan.protectColor[i]);
+      }
+      hash.append(plan.despillMath);
+      hash.append(plan.hueOffset);
+      hash.append(plan.hueLimit);
+      hash.append(plan.protectTones);
+      hash.append(plan.protectTolerance);
+    }
+  }
+
+  if(k_wedgeMode != Constants::WEDGE_OFF) {
+    hash.append(k_wedgeCount);
+    for(int i = 0; i < 2; i++) {
+      hash.append(k_wedgeOffset[i]);
+      hash.append(k_wedgeLimit[i]);
+      hash.append(k_wedgeTolerance[i]);
+    }
+    hash.append(k_wedgeMath);
+  }
+}
+
 const char *DespillAPIop::input_label(int n, char *) const
 {
   switch(n) {
@@ -237,6 +674,8 @@ const char *DespillAPIop::input_label(int n, char *) const
       return "Color";
     case 3:
       return "Respill";
+    case 4:
+      return "ID";
     default:
       return 0;
   }
@@ -260,6 +699,9 @@ void DespillAPIop::set_input(int i, Op *inputOp, int input, int offset)
     case inputRespill:
       isRespillConnected = isConnected;
       break;
+    case inputId:
+      isIdConnected = isConnected;
+      break;
   }
 
   if(!isColorConnected) {
@@ -272,332 +714,1178 @@ void DespillAPIop::set_input(int i, Op *inputOp, int input, int offset)
     knob("pick")->disable();
     knob("color")->disable();
   }
+  UpdateSharedKnobs();
 }
 
 void DespillAPIop::_validate(bool for_real)
 {
+  // rows queued for the previous knob values are dropped, the fetches the workers
+  // are running, one row each at most, are waited for before the knobs are read
+  {
+    std::unique_lock<std::mutex> lock(_prefetchMutex);
+    DropPrefetch(lock);
+  }
+  _requestX = _requestY = _requestR = _requestT = 0;
+
   // copy image info
   copy_info(0);
 
-  // setup output channels:
-  // include all requested channels plus our spill output channel
-  nuke::ChannelSet outChannels = channels();
-  outChannels += k_outputSpillChannel;
-  set_out_channels(outChannels);
-  info_.turn_on(outChannels);
+  // knob values and connected inputs for the kernel
+  _params.colorType = k_colorType;
+  for(int i = 0; i < 3; i++) {
+    _params.spillPick[i] = k_spillPick[i];
+    _params.protectColor[i] = k_protectColor[i];
+    _params.respillColor[i] = k_respillColor[i];
+  }
+  _params.pointCount = 0;
+  for(const SpillPointKnobs &point : k_spillPoints) {
+    if(point.enable) {
+      int p = _params.pointCount++;
+      _params.pointPosition[p][0] = point.position[0];
+      _params.pointPosition[p][1] = point.position[1];
+      for(int i = 0; i < 3; i++) {
+        _params.pointColor[p][i] = point.color[i];
+      }
+    }
+  }
+  _params.frameWidth = info_.format().width();
+  _params.frameHeight = info_.format().height();
+  _params.absMode = k_absMode;
+  _params.despillMath = k_despillMath;
+  _params.customWeight = k_customWeight;
+  _params.hueOffset = k_hueOffset;
+  _params.hueLimit = k_hueLimit;
+  _params.invertLimit = k_invertLimitMask;
+  _params.protectTones = k_protectTones;
+  _params.protectPreview = k_protectPrev;
+  _params.protectTolerance = k_protectTolerance;
+  _params.protectFalloff = k_protectFalloff;
+  _params.protectEffect = k_protectEffect;
+  _params.respillMath = k_respillMath;
+  _params.respillBlur = k_respillBlur;
+  _params.respillBlurSize = k_respillBlurSize;
+  _params.blackPoint = k_blackPoint;
+  _params.whitePoint = k_whitePoint;
+  _params.outputType = k_outputType;
+  _params.outputAlpha = k_outputAlpha;
+  _params.invertAlpha = k_invertAlpha;
+  _params.colorConnected = isColorConnected;
+  _params.respillConnected = isRespillConnected && k_respillBlur == Constants::BLUR_NONE;
+  _params.limitConnected = isLimitConnected;
+
+  // a uniform Color or Respill input (typically a Constant) is folded into the knob
+  // constants: it is no longer requested, and the spill color takes the row constant
+  // hue shift path. a gray color stays per pixel, the pick path would bypass it.
+  // the inputs are only read on open, a new input hash is folded from the next validate
+  _colorUniform.requested = _respillUniform.requested = false;
+  float uniform[3];
+  if(_params.colorConnected && CachedUniform(inputColor, _colorUniform, uniform) &&
+     !(uniform[0] == uniform[1] && uniform[0] == uniform[2])) {
+    _params.colorConnected = 0;
+    _params.colorType = Constants::COLOR_PICK;
+    for(int i = 0; i < 3; i++) {
+      _params.spillPick[i] = uniform[i];
+    }
+  }
+  if(_params.respillConnected && CachedUniform(inputRespill, _respillUniform, uniform)) {
+    _params.respillConnected = 0;
+    for(int i = 0; i < 3; i++) {
+      _params.respillColor[i] = uniform[i];
+    }
+  }
 
-  // initialize normalization vector for colorspace calcs
-  normVec = Vector3(1.0f, 1.0f, 1.0f);
+  // per object plans of the ID input, each overrides the spill color, math, limit
+  // and protect settings of the knobs above
+  std::vector<DespillIdPlan> plans;
+  if(isIdConnected) {
+    for(const IdPlanKnobs &knobs : k_idPlans) {
+      if(!knobs.enable) {
+        continue;
+      }
+      DespillIdPlan plan;
+      plan.id = knobs.id;
+      plan.params = _params;
+      plan.params.colorConnected = 0;
+      plan.params.colorType = Constants::COLOR_PICK;
+      for(int i = 0; i < 3; i++) {
+        plan.params.spillPick[i] = knobs.pick[i];
+        plan.params.protectColor[i] = knobs.protectColor[i];
+      }
+      plan.params.despillMath = knobs.despillMath;
+      plan.params.hueOffset = knobs.hueOffset;
+      plan.params.hueLimit = knobs.hueLimit;
+      plan.params.protectTones = knobs.protectTones;
+      plan.params.protectTolerance = knobs.protectTolerance;
+      plans.push_back(plan);
+    }
+  }
 
-  // get the picked spill color
-  Vector3 pickSpill(k_spillPick);
+  // spill color, hue shift and the per pixel state are derived once here
+  _kernel.Prepare(_params, plans.data(), static_cast<int>(plans.size()));
 
-  // determine color selection mode
-  // and setup internal variables
-  if(isColorConnected) {
-    // color input is connected:
-    // use automatic color detection
-    _clr = 0;             // red channel
-    _usePickedColor = 1;  // flag to use picked color
+  // the box of the Limit input bounds the rows it is read on, the rows past it
+  // repeat its edge rows and are tested on first use
+  _limitBox.set(0, 0, 0, 0);
+  _limitEdgeZero[0] = _limitEdgeZero[1] = -1;
+  if(isLimitConnected) {
+    input(inputLimit)->validate(for_real);
+    _limitBox = input(inputLimit)->info().box();
   }
-  else if(k_colorType != Constants::COLOR_PICK) {
-    // manual channel selection (Red/Green/Blue butons)
-    _usePickedColor = 0;  // use channel selection, not picked color
-    _clr = k_colorType;   // use selected channel (0=Red, 1=Green, 2=Blue)
+
+  // wedge variants of the knobs above, spread evenly over the wedge ranges. the
+  // contact sheet shows the frame scaled down by the number of columns, its spill
+  // points are scaled into the tile
+  _wedgeKernels.clear();
+  if(k_wedgeMode != Constants::WEDGE_OFF) {
+    const int count = MAX(MIN(k_wedgeCount, Constants::WEDGE_MAX), 1);
+    const Format &format = info_.format();
+    _sheetColumns = static_cast<int>(std::ceil(std::sqrt(static_cast<float>(count))));
+    _wedgeKernels.resize(count);
+    for(int v = 0; v < count; v++) {
+      float t = count > 1 ? static_cast<float>(v) / (count - 1) : 0.0f;
+      DespillParams variant = _params;
+      variant.hueOffset = k_wedgeOffset[0] + (k_wedgeOffset[1] - k_wedgeOffset[0]) * t;
+      variant.hueLimit = k_wedgeLimit[0] + (k_wedgeLimit[1] - k_wedgeLimit[0]) * t;
+      variant.protectTolerance =
+          k_wedgeTolerance[0] + (k_wedgeTolerance[1] - k_wedgeTolerance[0]) * t;
+      if(k_wedgeMath) {
+        variant.despillMath = v % 4;
+      }
+      if(k_wedgeMode == Constants::WEDGE_SHEET) {
+        for(int p = 0; p < variant.pointCount; p++) {
+          variant.pointPosition[p][0] = (variant.pointPosition[p][0] - format.x()) / _sheetColumns;
+          variant.pointPosition[p][1] = (variant.pointPosition[p][1] - format.y()) / _sheetColumns;
+        }
+        variant.frameWidth = format.width() / _sheetColumns;
+        variant.frameHeight = format.height() / _sheetColumns;
+      }
+      _wedgeKernels[v].Prepare(variant);
+    }
   }
-  else if(pickSpill.x == pickSpill.y && pickSpill.x == pickSpill.z) {
-    // if picked color is grayscale (all rgb values equal)
-    // this means that no valid color was picked,
-    // so pass trought input unchanged
-    _returnColor = 1;  // bypass all processing
+
+  // the blurred source is kept while the source, the filter and its size are the
+  // same, and released when not in use
+  Hash blurKey;
+  if(k_respillBlur != Constants::BLUR_NONE && !_kernel.Bypass()) {
+    blurKey.append(input(inputSource)->hash().value());
+    blurKey.append(k_respillBlur);
+    blurKey.append(k_respillBlurSize);
   }
-  else {
-    // valid color was picked from picker knob
-    _usePickedColor = 1;  // use the picked color
-    _clr = 0;             // default processing channel
+  if(blurKey.value() != _blurKey) {
+    Guard guard(_blurLock);
+    _blurKey = blurKey.value();
+    _blurFrame.reset();
+    _blurWindows.clear();
   }
 
-  // calculate hue shift for non connected color mode
-  if(!isColorConnected) {
-    float _autoShift = 0.0f;
+  // the disk cache is set up again below
+  _cacheReader.Close();
+  _cacheWriter.Reset("", 0, 0, 0, 0, 0, 0);
 
-    if(_usePickedColor == 1) {
-      // calculate automatic hue shift based on picked color
-      // convert picked color and red reference to plane vectors for angle calc
-      Vector3 v1 = color::VectorToPlane(k_spillPick, normVec);
-      Vector3 v2 = color::VectorToPlane(Vector3(1.0f, 0.0f, 0.0f), normVec);  // red reference
+  // case: no valid spill color, the node changes nothing. with no output channels
+  // Nuke hands the input rows through without calling engine or copying
+  if(_kernel.Bypass()) {
+    set_out_channels(Mask_None);
+    return;
+  }
+
+  // setup output channels:
+  // include all requested channels plus our spill output channel
+  nuke::ChannelSet outChannels = channels();
+  outChannels += k_outputSpillChannel;
 
-      // calculate angle between picked color and red reference
-      _autoShift = color::ColorAngle(v1, v2);
-      _autoShift = _autoShift * 180.0f / M_PI_F;  // rads to deg
+  // wedge layers carry the despilled rgb and the spill alpha of each variant
+  if(k_wedgeMode == Constants::WEDGE_LAYERS) {
+    static const char *const suffixes[] = {".red", ".green", ".blue", ".alpha"};
+    for(size_t v = 0; v < _wedgeKernels.size(); v++) {
+      std::string layer = "wedge" + std::to_string(v + 1);
+      for(int c = 0; c < 4; c++) {
+        _wedgeChannels[v][c] = nuke::getChannel((layer + suffixes[c]).c_str());
+        outChannels += _wedgeChannels[v][c];
+      }
     }
+  }
+  set_out_channels(outChannels);
+  info_.turn_on(outChannels);
 
-    // final hue shift: user offset - automatic shift
-    // this allows user to fine-tune the calculated shift
-    _hueShift = k_hueOffset - _autoShift;
+  // spill estimates on disk: read back when the file of this key exists, else
+  // collected as the rows render. protect preview has no estimate, the contact sheet
+  // decimates the frame, and a bypassed id plan leaves the alpha as is where the
+  // estimate would compose one
+  bool preview = k_protectTones && k_protectPrev;
+  if(for_real && k_spillCache && k_spillCacheDir && k_spillCacheDir[0] != '\0' && !preview &&
+     k_wedgeMode != Constants::WEDGE_SHEET && !_kernel.HasPlans()) {
+    const Box &box = info_.box();
+    uint64_t key = SpillKey();
+    std::string path = spillcache::CachePath(k_spillCacheDir, key);
+    if(!_cacheReader.Open(path, key, box.x(), box.y(), box.w(), box.h())) {
+      _cacheWriter.Reset(path, key, box.x(), box.y(), box.w(), box.h(),
+                         static_cast<uint64_t>(MAX(k_spillCacheSize, 0)) << 20);
+    }
   }
 }
 
+uint64_t DespillAPIop::SpillKey()
+{
+  // the respill, the luma range and the output are composed from the estimate, they
+  // are left out of the key
+  auto estimateParams = [](DespillParams params) {
+    for(int i = 0; i < 3; i++) {
+      params.respillColor[i] = 0.0f;
+    }
+    params.respillBlur = 0;
+    params.respillBlurSize = 0.0f;
+    params.respillConnected = 0;
+    params.blackPoint = 0.0f;
+    params.whitePoint = 0.0f;
+    params.outputType = 0;
+    params.outputAlpha = 0;
+    params.invertAlpha = 0;
+    for(int p = params.pointCount; p < DESPILL_MAX_POINTS; p++) {
+      params.pointPosition[p][0] = params.pointPosition[p][1] = 0.0f;
+      params.pointColor[p][0] = params.pointColor[p][1] = params.pointColor[p][2] = 0.0f;
+    }
+    return params;
+  };
+
+  Hash key;
+  DespillParams params = estimateParams(_params);
+  key.append(&params, sizeof(params));
+
+  // and the inputs the estimate reads
+  key.append(input(inputSource)->hash().value());
+  if(_params.colorConnected) {
+    key.append(input(inputColor)->hash().value());
+  }
+  if(isLimitConnected) {
+    key.append(input(inputLimit)->hash().value());
+    key.append(static_cast<int>(k_limitChannel));
+  }
+  return key.value();
+}
+
 void DespillAPIop::_request(int x, int y, int r, int t, ChannelMask channels, int count)
 {
-  // ensure RGB channels are always requested for processing
+  // passthrough: only the source rows are handed on, also when no output of the
+  // node is wanted
+  Demand demand = ChannelDemand(channels);
+  if(_kernel.Bypass() || (!demand.rgb && !demand.matte && !demand.layers)) {
+    input(inputSource)->request(x, y, r, t, channels, count);
+    return;
+  }
+
+  // rows are only prefetched inside the requested ones, and only the requested
+  // pixels are blurred
+  if(_requestT > _requestY) {
+    _requestX = MIN(_requestX, x);
+    _requestY = MIN(_requestY, y);
+    _requestR = MAX(_requestR, r);
+    _requestT = MAX(_requestT, t);
+  }
+  else {
+    _requestX = x;
+    _requestY = y;
+    _requestR = r;
+    _requestT = t;
+  }
+
+  // ensure RGB channels are always requested for processing, and the alpha the
+  // spill mattes may pass through
   nuke::ChannelSet requestedChannels = channels;
   requestedChannels += Mask_RGB;
+  if(demand.matte || demand.layers) {
+    requestedChannels += Mask_Alpha;
+  }
 
-  // request data fron input 'Source'
-  input(inputSource)->request(input(inputSource)->info().box(), requestedChannels, Mask_RGB);
+  // request data fron input 'Source'. the respill blur reads the wanted pixels and
+  // the reach of its filter once more. the spill matte alone has no respill
+  bool readRespill = demand.rgb || demand.layers;
+  const Box &sourceBox = input(inputSource)->info().box();
+  input(inputSource)->request(sourceBox, requestedChannels, count);
+  if(readRespill && k_respillBlur != Constants::BLUR_NONE) {
+    const int reach = blur::BlurReach(k_respillBlur, k_respillBlurSize);
+    Box blurArea = BlurWanted();
+    blurArea.set(blurArea.x() - reach, blurArea.y() - reach, blurArea.r() + reach,
+                 blurArea.t() + reach);
+    blurArea.intersect(sourceBox);
+    if(blurArea.w() > 0 && blurArea.h() > 0) {
+      input(inputSource)->request(blurArea, Mask_RGB, 1);
+    }
+  }
+
+  // a cached spill estimate replaces the Limit, Color and ID inputs
+  bool readEstimate = !_cacheReader.IsOpen() || demand.layers;
 
   // request limit matte if its connected to input 'Limit'
   // take only what fits from the Op format, based on the input limit.
-  if(input(inputLimit) != nullptr) {
+  if(input(inputLimit) != nullptr && readEstimate) {
     input(inputLimit)->request(input(inputLimit)->info().format(), Mask_All, count);
   };
 
-  // request color reference if its connected to input 'Color'
-  if(input(inputColor) != nullptr) {
+  // request color reference if its connected to input 'Color' and not uniform
+  if(input(inputColor) != nullptr && _params.colorConnected && readEstimate) {
     input(inputColor)->request(input(inputColor)->info().box(), Mask_RGB, count);
+    _colorUniform.requested = true;
   };
 
-  // request respill color if its connected to input 'Respill'
-  if(input(inputRespill) != nullptr) {
+  // request the id channel if plans are in use
+  if(_kernel.HasPlans() && readEstimate) {
+    input(inputId)->request(input(inputId)->info().box(), nuke::ChannelSet(k_idChannel), count);
+  }
+
+  // request respill color if its connected to input 'Respill' and not uniform
+  if(input(inputRespill) != nullptr && _params.respillConnected && readRespill) {
     input(inputRespill)->request(input(inputRespill)->info().box(), Mask_RGB, count);
+    _respillUniform.requested = true;
   };
 }
 
+bool DespillAPIop::CachedUniform(int n, const UniformSample &sample, float (&value)[3])
+{
+  Iop *op = input(n);
+  if(op == nullptr || !sample.sampled || !sample.uniform || sample.hash != op->hash().value()) {
+    return false;
+  }
+  std::copy(sample.value, sample.value + 3, value);
+  return true;
+}
+
+void DespillAPIop::SampleUniform(int n, UniformSample &sample)
+{
+  Iop *op = input(n);
+  if(op == nullptr || !sample.requested ||
+     (sample.sampled && sample.hash == op->hash().value())) {
+    return;
+  }
+  op->validate(true);
+  sample.hash = op->hash().value();
+  sample.sampled = true;
+  sample.uniform = false;
+  const Box &box = op->info().box();
+  if(box.w() <= 0 || box.h() <= 0) {
+    return;
+  }
+
+  // every pixel of the box, repeated past it by the edge rule, holds the first one.
+  // the rows are read until one differs, an image differs on its first row
+  Row sample_row(box.x(), box.r());
+  for(int y = box.y(); y < box.t(); ++y) {
+    sample_row.get(*op, y, box.x(), box.r(), Mask_RGB);
+    if(aborted()) {
+      sample.sampled = false;
+      return;
+    }
+    for(int i = 0; i < 3; i++) {
+      const float *samplePtr = sample_row[static_cast<nuke::Channel>(i + 1)];
+      if(y == box.y()) {
+        sample.value[i] = samplePtr[box.x()];
+      }
+      for(int x = box.x(); x < box.r(); ++x) {
+        if(!(samplePtr[x] == sample.value[i])) {
+          return;
+        }
+      }
+    }
+  }
+  sample.uniform = true;
+}
+
+bool DespillAPIop::LimitEdgeZero(int edge)
+{
+  // the rows past an edge of the Limit box repeat its edge row, a single row read
+  // once per validate tells whether they all have zero strength
+  Guard guard(_limitLock);
+  if(_limitEdgeZero[edge] < 0) {
+    const Box &box = _limitBox;
+    const int y = edge == 0 ? box.y() : box.t() - 1;
+    Row edge_row(box.x(), box.r());
+    edge_row.get(*input(inputLimit), y, box.x(), box.r(), ChannelSet(k_limitChannel));
+    if(aborted()) {
+      return false;
+    }
+    const float *limitPtr = edge_row[k_limitChannel];
+    const float limitZero = _kernel.Base().LimitZero();
+    bool zero = scan::FindRunEnd(limitPtr, 1, box.x(), box.r(), limitZero, true) == box.r();
+    _limitEdgeZero[edge] = zero ? 1 : 0;
+  }
+  return _limitEdgeZero[edge] == 1;
+}
+
+Box DespillAPIop::BlurWanted() const
+{
+  // the requested area of the node, the contact sheet reads rows and columns of the
+  // whole frame
+  Box wanted = info_.box();
+  if(k_wedgeMode != Constants::WEDGE_SHEET && _requestT > _requestY) {
+    wanted.intersect(Box(_requestX, _requestY, _requestR, _requestT));
+  }
+  return wanted;
+}
+
+std::shared_ptr<const DespillAPIop::BlurFrame> DespillAPIop::BlurSource(const Box &valid,
+                                                                        int reach)
+{
+  std::shared_ptr<BlurFrame> frame = std::make_shared<BlurFrame>();
+  frame->valid = valid;
+  frame->area.set(valid.x() - reach, valid.y() - reach, valid.r() + reach, valid.t() + reach);
+  frame->area.intersect(info_.box());
+  const Box &area = frame->area;
+  const int width = area.w();
+  const int height = area.h();
+  const size_t size = static_cast<size_t>(width) * height;
+  frame->planes.resize(3 * size);
+
+  // the area is filled on the threads of the Nuke pool
+  {
+    Tile source_tile(input0(), area, Mask_RGB, true);
+    if(aborted() || !source_tile.valid()) {
+      return nullptr;
+    }
+    for(int c = 0; c < 3; ++c) {
+      const nuke::Channel z = static_cast<nuke::Channel>(c + 1);
+      for(int y = area.y(); y < area.t(); ++y) {
+        const float *in = source_tile[z][y] + area.x();
+        std::copy(in, in + width, frame->planes.begin() + c * size + (y - area.y()) * width);
+      }
+    }
+  }
+
+  // each thread blurs a band of rows of the three planes, then a band of columns
+  const int threads = MAX(MIN(static_cast<int>(Thread::numThreads), height), 1);
+  _blurBuild = frame.get();
+  _blurColumns = false;
+  Thread::spawn(BlurBands, threads, this);
+  Thread::wait(this);
+  _blurColumns = true;
+  Thread::spawn(BlurBands, threads, this);
+  Thread::wait(this);
+  _blurBuild = nullptr;
+  if(aborted()) {
+    return nullptr;
+  }
+  return frame;
+}
+
+void DespillAPIop::BlurBands(unsigned index, unsigned threads, void *data)
+{
+  DespillAPIop *op = static_cast<DespillAPIop *>(data);
+  const Box &area = op->_blurBuild->area;
+  const int width = area.w();
+  const int height = area.h();
+  const size_t size = static_cast<size_t>(width) * height;
+  const int extent = op->_blurColumns ? width : height;
+  const int b0 = static_cast<int>(static_cast<int64_t>(extent) * index / threads);
+  const int b1 = static_cast<int>(static_cast<int64_t>(extent) * (index + 1) / threads);
+  for(int c = 0; c < 3; ++c) {
+    float *plane = op->_blurBuild->planes.data() + c * size;
+    if(op->_blurColumns) {
+      blur::BlurColumns(plane, width, height, op->k_respillBlur, op->k_respillBlurSize, b0, b1);
+    }
+    else {
+      blur::BlurRows(plane, width, height, op->k_respillBlur, op->k_respillBlurSize, b0, b1);
+    }
+  }
+}
+
 void DespillAPIop::engine(int y, int x, int r, ChannelMask channels, Row &row)
 {
   callCloseAfter(0);
   ProcessCPU(y, x, r, channels, row);
 }
 
-void DespillAPIop::ProcessCPU(int y, int x, int r, ChannelMask channels, Row &row)
+void DespillAPIop::_open()
 {
-  // get main input data
-  nuke::ChannelSet requestedChannels = channels;
-  requestedChannels += Mask_RGBA;  // Add RGBA
-  row.get(input0(), y, x, r, requestedChannels);
+  // the Color and Respill inputs read per pixel are tested once per hash, before the
+  // workers read them
+  SampleUniform(inputColor, _colorUniform);
+  SampleUniform(inputRespill, _respillUniform);
+
+  // the prefetch depth changes no pixel and is read here, the ring holds the rows
+  // ahead of every rendering thread. the workers live from open to close, a worker
+  // that cannot be started leaves its rows to the rendering threads
+  std::lock_guard<std::mutex> lock(_prefetchMutex);
+  _prefetchDepth = MAX(k_prefetchDepth, 0);
+  _prefetchRing.assign(_prefetchDepth > 0 ? _prefetchDepth + MAX(Thread::numThreads, 1) : 0,
+                       PrefetchSlot());
+  // one worker for each input of the rendered row, and one more for each row ahead
+  const int workers = _prefetchRing.empty()
+                          ? 0
+                          : MAX(MIN(AUX_COUNT + _prefetchDepth - 1,
+                                    static_cast<int>(Thread::numThreads)),
+                                1);
+  _prefetchStop = false;
+  try {
+    while(static_cast<int>(_prefetchWorkers.size()) < workers) {
+      _prefetchWorkers.emplace_back(&DespillAPIop::PrefetchWorker, this);
+    }
+  }
+  catch(const std::system_error &) {
+  }
+}
 
-  // copy all non rgb channels
-  nuke::ChannelSet copyMask = channels - nuke::Mask_RGB;
-  row.pre_copy(row, copyMask);
-  row.copy(row, copyMask, x, r);
+void DespillAPIop::_close()
+{
+  // the workers are joined, rows queued ahead of the end of the render are dropped
+  StopPrefetch();
 
-  // get input color reference (for atm color detection)
-  Row color_row(x, r);
-  if(input(inputColor) != nullptr) {
-    color_row.get(*input(inputColor), y, x, r, Mask_RGB);
+  // knobs are not set off the main thread, knob_changed shows the wait
+  int64_t waitUs = _fetchWaitUs.exchange(0);
+  if(_prefetchDepth > 0) {
+    _prefetchWaitUs = waitUs;
   }
+}
 
-  // get optional respill color input (custom replacement color)
-  Row respill_row(x, r);
-  if(input(inputRespill) != nullptr) {
-    respill_row.get(*input(inputRespill), y, x, r, Mask_RGB);
+DespillAPIop::Demand DespillAPIop::ChannelDemand(ChannelMask channels) const
+{
+  Demand demand;
+  demand.rgb =
+      channels.contains(Chan_Red) || channels.contains(Chan_Green) || channels.contains(Chan_Blue);
+  demand.matte = channels.contains(k_outputSpillChannel);
+  demand.layers = false;
+  if(k_wedgeMode == Constants::WEDGE_LAYERS) {
+    for(size_t v = 0; v < _wedgeKernels.size(); v++) {
+      for(int c = 0; c < 4; c++) {
+        demand.layers = demand.layers || channels.contains(_wedgeChannels[v][c]);
+      }
+    }
   }
+  return demand;
+}
 
-  // get limit matte input
-  Row limit_matte_row(x, r);
-  const float *limitPtr;
-  if(input(inputLimit) != nullptr) {
-    limit_matte_row.get(*input(inputLimit), y, x, r, Mask_All);
+bool DespillAPIop::BlurRespill(int y, int x, int r, Row &respill)
+{
+  float *out[3];
+  for(int c = 0; c < 3; ++c) {
+    out[c] = respill.writable(static_cast<nuke::Channel>(c + 1));
   }
-  if(input(inputLimit) != nullptr) {
-    limitPtr = limit_matte_row[k_limitChannel] + x;
+  const Box &box = info_.box();
+  if(box.w() <= 0 || box.h() <= 0) {
+    for(int c = 0; c < 3; ++c) {
+      std::fill(out[c] + x, out[c] + r, 0.0f);
+    }
+    return true;
   }
 
-  Vector3 rgb;
-  Vector3 colorRgb;
-  Vector3 respillRgb;
-
-  // pixel pointers for multichannel processing
-  std::array<const float *, 3> inPtr;
-  std::array<const float *, 3> colorPtr;
-  std::array<const float *, 3> respillPtr;
-  std::array<float *, 3> outPtr;
+  // the row is blurred with the wanted pixels around it, outside the box the edge
+  // pixels repeat
+  const int filter = k_respillBlur;
+  const float radius = k_respillBlurSize;
+  const int reach = blur::BlurReach(filter, radius);
+  const int by = box.clampy(y);
+  Box wanted(box.clampx(x), by, box.clampx(r - 1) + 1, by + 1);
+  Box requested = BlurWanted();
+  if(requested.w() > 0 && requested.h() > 0) {
+    wanted.merge(requested);
+  }
 
-  // get pointer to input alpha channel for pass-throught
-  const float *input_alpha = row[Chan_Alpha] + x;
+  // Gaussian: the planes are blurred again only when the row is past the pixels they
+  // hold, the rows reading the old ones keep them until done
+  if(!blur::BoxFilter(filter, radius)) {
+    std::shared_ptr<const BlurFrame> frame;
+    {
+      Guard guard(_blurLock);
+      frame = _blurFrame;
+      if(!frame || frame->valid.x() > wanted.x() || frame->valid.r() < wanted.r() ||
+         frame->valid.y() > by || frame->valid.t() <= by) {
+        if(frame) {
+          wanted.merge(frame->valid);
+        }
+        frame = BlurSource(wanted, reach);
+        if(!frame) {
+          return false;
+        }
+        _blurFrame = frame;
+      }
+    }
+    const Box &area = frame->area;
+    const size_t size = static_cast<size_t>(area.w()) * area.h();
+    for(int c = 0; c < 3; ++c) {
+      const float *plane =
+          frame->planes.data() + c * size + static_cast<size_t>(by - area.y()) * area.w();
+      for(int x0 = x; x0 < r; ++x0) {
+        out[c][x0] = plane[box.clampx(x0) - area.x()];
+      }
+    }
+    return true;
+  }
 
-  // lambda to increment all pixel pointers
-  auto incrementPointers = [&]() {
-    for(int i = 0; i < 3; ++i) {
-      ++inPtr[i];
-      ++outPtr[i];
-      if(input(inputColor) != nullptr) {
-        ++colorPtr[i];
+  // box: an idle window of the columns at or nearest above the row is taken, a
+  // window of other columns is reset
+  const int cx = MAX(wanted.x() - reach, box.x());
+  const int width = MIN(wanted.r() + reach, box.r()) - cx;
+  std::unique_ptr<BlurWindow> window;
+  {
+    Guard guard(_blurLock);
+    auto best = _blurWindows.end();
+    int bestRank = INT_MIN;
+    for(auto it = _blurWindows.begin(); it != _blurWindows.end(); ++it) {
+      const BlurWindow &idle = **it;
+      int rank = idle.window.Position();
+      if(idle.x != cx || idle.width != width) {
+        rank = INT_MIN + 1;
+      }
+      else if(rank > by) {
+        rank = INT_MIN + 2;
       }
-      if(input(inputRespill) != nullptr) {
-        ++respillPtr[i];
+      if(best == _blurWindows.end() || rank > bestRank) {
+        best = it;
+        bestRank = rank;
       }
     }
-    ++input_alpha;
-    if(input(inputLimit) != nullptr) {
-      ++limitPtr;
+    if(best != _blurWindows.end()) {
+      window = std::move(*best);
+      _blurWindows.erase(best);
     }
+  }
+  bool reset = !window || window->x != cx || window->width != width;
+  if(!window) {
+    window.reset(new BlurWindow());
+  }
+  if(reset) {
+    window->x = cx;
+    window->width = width;
+    window->window.Reset(width, 3, radius, box.y(), box.t());
+    window->blurred.resize(3 * static_cast<size_t>(width));
+  }
+
+  Row source(cx, cx + width);
+  auto read = [&](int sy, float *line) {
+    source.get(input0(), sy, cx, cx + width, Mask_RGB);
+    if(aborted()) {
+      return false;
+    }
+    for(int c = 0; c < 3; ++c) {
+      const float *in = source[static_cast<nuke::Channel>(c + 1)] + cx;
+      std::copy(in, in + width, line + c * width);
+    }
+    return true;
   };
+  bool blurred = window->window.Blur(by, read, window->blurred.data());
+  if(blurred) {
+    for(int c = 0; c < 3; ++c) {
+      const float *line = window->blurred.data() + c * width;
+      for(int x0 = x; x0 < r; ++x0) {
+        out[c][x0] = line[box.clampx(x0) - cx];
+      }
+    }
+  }
+  Guard guard(_blurLock);
+  _blurWindows.push_back(std::move(window));
+  return blurred;
+}
 
-  // set pixel pointers to point to RGB channels
-  for(int i = 0; i < 3; ++i) {
-    auto chan = static_cast<nuke::Channel>(i + 1);
-    inPtr[i] = row[chan] + x;
-    outPtr[i] = row.writable(chan) + x;
-    colorPtr[i] = color_row[chan] + x;
-    respillPtr[i] = respill_row[chan] + x;
+bool DespillAPIop::InputInUse(int aux, bool readRespill, bool readEstimate) const
+{
+  switch(aux) {
+    case AUX_COLOR:
+      return readEstimate && _params.colorConnected;
+    case AUX_RESPILL:
+      return readRespill &&
+             (_params.respillConnected || _params.respillBlur != Constants::BLUR_NONE);
+    case AUX_ID:
+      return readEstimate && _kernel.HasPlans();
+    case AUX_LIMIT:
+      return readEstimate && isLimitConnected;
   }
+  return false;
+}
 
-  // Main pixel loop
-  for(int x0 = x; x0 < r; ++x0) {
-    // read rgb values from the current pixel
-    for(int i = 0; i < 3; i++) {
-      rgb[i] = *inPtr[i];
-      colorRgb[i] = *colorPtr[i];
-      respillRgb[i] = *respillPtr[i];
+bool DespillAPIop::FetchInput(int aux, int y, int x, int r, bool readRespill,
+                              bool readEstimate, InputRows &rows)
+{
+  if(!InputInUse(aux, readRespill, readEstimate)) {
+    return true;
+  }
+
+  // get input color reference (for atm color detection)
+  if(aux == AUX_COLOR) {
+    rows.color.get(*input(inputColor), y, x, r, Mask_RGB);
+    return true;
+  }
+
+  // get optional respill color input (custom replacement color), or the blurred
+  // source
+  if(aux == AUX_RESPILL) {
+    if(_params.respillConnected) {
+      rows.respill.get(*input(inputRespill), y, x, r, Mask_RGB);
+      return true;
     }
+    return BlurRespill(y, x, r, rows.respill);
+  }
 
-    // early exit if color is unchanged
-    if(_returnColor == 1) {
-      incrementPointers();
-      continue;
+  // get the id channel of the plans
+  if(aux == AUX_ID) {
+    rows.id.get(*input(inputId), y, x, r, nuke::ChannelSet(k_idChannel));
+    return true;
+  }
+
+  // the limit is read while any kernel has strength
+  bool zeroStrength = _kernel.ZeroStrength();
+  for(const despill::Kernel &variant : _wedgeKernels) {
+    zeroStrength = zeroStrength && variant.ZeroStrength();
+  }
+  bool limitActive = !zeroStrength && !_kernel.Bypass();
+
+  // get limit matte input, rows past the Limit box whose edge row has zero strength
+  // everywhere skip the fetch. zero runs inside a row are skipped by the kernel
+  if(limitActive && _limitBox.w() > 0 && _limitBox.h() > 0) {
+    if(y < _limitBox.y()) {
+      limitActive = !LimitEdgeZero(0);
     }
+    else if(y >= _limitBox.t()) {
+      limitActive = !LimitEdgeZero(1);
+    }
+  }
+  rows.limitActive = limitActive;
+  if(rows.limitActive) {
+    rows.limit.get(*input(inputLimit), y, x, r, Mask_All);
+  }
+  return true;
+}
+
+bool DespillAPIop::FetchInputs(int y, int x, int r, bool readRespill, bool readEstimate,
+                               InputRows &rows)
+{
+  for(int aux = 0; aux < AUX_COUNT; ++aux) {
+    if(!FetchInput(aux, y, x, r, readRespill, readEstimate, rows)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+std::shared_ptr<DespillAPIop::InputFetch> DespillAPIop::MakeFetch(int y, int x, int r,
+                                                                   bool readRespill) const
+{
+  std::shared_ptr<InputFetch> fetch = std::make_shared<InputFetch>(y, x, r, readRespill);
+  for(int aux = 0; aux < AUX_COUNT; ++aux) {
+    if(InputInUse(aux, readRespill, true)) {
+      fetch->state[aux] = InputFetch::QUEUED;
+      ++fetch->pending;
+    }
+  }
+  return fetch;
+}
+
+void DespillAPIop::QueueFetch(const std::shared_ptr<InputFetch> &fetch)
+{
+  for(int aux = 0; aux < AUX_COUNT; ++aux) {
+    if(fetch->state[aux] == InputFetch::QUEUED) {
+      _prefetchQueue.push_back(FetchTask{fetch, aux});
+    }
+  }
+}
+
+void DespillAPIop::SkipFetch(InputFetch &fetch)
+{
+  for(int aux = 0; aux < AUX_COUNT; ++aux) {
+    if(fetch.state[aux] == InputFetch::QUEUED) {
+      fetch.state[aux] = InputFetch::DONE;
+      fetch.fetched = false;
+      --fetch.pending;
+    }
+  }
+}
+
+std::shared_ptr<DespillAPIop::InputFetch> DespillAPIop::QueueInputs(int y, int x, int r,
+                                                                     bool readRespill)
+{
+  // case: prefetch off, no worker, or no input to wait on. the rows are fetched when
+  // waited for
+  std::shared_ptr<InputFetch> fetch;
+  if(_prefetchRing.empty() || _prefetchWorkers.empty()) {
+    return MakeFetch(y, x, r, readRespill);
+  }
 
-    float spillMatte = 0.0f;
-    float hueShift = 0.0f;
-    float autoShift = 0.0f;
-    Vector3 despillColor;
+  {
+    std::lock_guard<std::mutex> lock(_prefetchMutex);
+    const int size = static_cast<int>(_prefetchRing.size());
+    auto slotOf = [&](int row) -> PrefetchSlot & {
+      return _prefetchRing[((row % size) + size) % size];
+    };
+    // the inputs of a fetch dropped from the ring before a worker took them are
+    // skipped
+    auto drop = [this](PrefetchSlot &slot) {
+      if(slot.fetch) {
+        SkipFetch(*slot.fetch);
+      }
+      slot = PrefetchSlot();
+    };
 
-    // determine despill color and hue shift
-    if(isColorConnected) {
-      // use color from connected input for atm color detection
-      despillColor = colorRgb;
-      Vector3 v1 = color::VectorToPlane(despillColor);
-      Vector3 v2 = color::VectorToPlane(Vector3(1.0f, 0.0f, 0.0f));
-      autoShift = color::ColorAngle(v1, v2);
-      autoShift = autoShift * 180.0f / M_PI_F;  // rad to deg
-      hueShift = k_hueOffset - autoShift;
+    // this row, queued by an earlier row or now, the workers take its inputs while the
+    // source row is read
+    PrefetchSlot &own = slotOf(y);
+    const InputFetch *queued = own.fetch.get();
+    if(own.y == y && queued && queued->x == x && queued->r == r &&
+       queued->readRespill == readRespill) {
+      fetch = std::move(own.fetch);
     }
     else {
-      // use manual color detection
-      if(_usePickedColor == 1) {
-        despillColor = Vector3(k_spillPick);
+      fetch = MakeFetch(y, x, r, readRespill);
+      if(fetch->pending == 0) {
+        return fetch;
       }
-      else {
-        // create a color constant based on selected channel
-        // 0=red, 1=green, 2=blue
-        despillColor =
-            Vector3(_clr == 0 ? 1.0f : 0.0f, _clr == 1 ? 1.0f : 0.0f, _clr == 2 ? 1.0f : 0.0f);
+      QueueFetch(fetch);
+    }
+    drop(own);
+    own.y = y;
+
+    // and the requested rows above it not queued yet
+    const int last = MIN(y + _prefetchDepth, _requestT - 1);
+    for(int ahead = MAX(y + 1, _requestY); ahead <= last; ++ahead) {
+      PrefetchSlot &slot = slotOf(ahead);
+      if(slot.y == ahead) {
+        continue;
       }
-      hueShift = _hueShift;
+      drop(slot);
+      slot.y = ahead;
+      slot.fetch = MakeFetch(ahead, x, r, readRespill);
+      QueueFetch(slot.fetch);
     }
+  }
+  _prefetchWake.notify_all();
+  return fetch;
+}
 
-    // apply limit matte if connected
-    float invertInputLimit = k_invertLimitMask ? (1.0f - (*limitPtr)) : *limitPtr;
-    float limitResult = isLimitConnected ? k_hueLimit * invertInputLimit : k_hueLimit;
+bool DespillAPIop::WaitInputs(InputFetch &fetch)
+{
+  // the inputs no worker has taken yet are run here
+  auto start = std::chrono::steady_clock::now();
+  std::unique_lock<std::mutex> lock(_prefetchMutex);
+  for(int aux = 0; aux < AUX_COUNT; ++aux) {
+    if(fetch.state[aux] == InputFetch::QUEUED) {
+      RunFetch(lock, fetch, aux);
+    }
+  }
+  _prefetchDone.wait(lock, [&fetch]() { return fetch.pending == 0; });
+  if(_prefetchDepth > 0) {
+    auto wait = std::chrono::steady_clock::now() - start;
+    _fetchWaitUs += std::chrono::duration_cast<std::chrono::microseconds>(wait).count();
+  }
+  return fetch.fetched;
+}
 
-    // perform limit operation
-    Vector4 rawDespilled = color::Despill(rgb, hueShift, _clr, k_despillMath, limitResult,
-                                          k_customWeight, k_protectTones, k_protectColor,
-                                          k_protectTolerance, k_protectEffect, k_protectFalloff);
+void DespillAPIop::RunFetch(std::unique_lock<std::mutex> &lock, InputFetch &fetch, int aux)
+{
+  fetch.state[aux] = InputFetch::RUNNING;
+  ++_prefetchRunning;
+  lock.unlock();
+  bool fetched =
+      FetchInput(aux, fetch.y, fetch.x, fetch.r, fetch.readRespill, true, fetch.rows);
+  lock.lock();
+  fetch.fetched = fetch.fetched && fetched;
+  fetch.state[aux] = InputFetch::DONE;
+  --fetch.pending;
+  --_prefetchRunning;
+  _prefetchDone.notify_all();
+}
 
-    // case: if tones are protected, output protection matte
-    if(k_protectPrev && k_protectTones) {
-      for(int i = 0; i < 3; i++) {
-        *outPtr[i] = rgb[i] * clamp(rawDespilled.w * k_protectEffect, 0.0f, 1.0f);
-      }
-      // move to next pixel channel
-      incrementPointers();
-      continue;
+void DespillAPIop::PrefetchWorker()
+{
+  std::unique_lock<std::mutex> lock(_prefetchMutex);
+  while(true) {
+    _prefetchWake.wait(lock, [this]() { return _prefetchStop || !_prefetchQueue.empty(); });
+    if(_prefetchStop) {
+      return;
+    }
+    FetchTask task = std::move(_prefetchQueue.front());
+    _prefetchQueue.pop_front();
+    if(task.fetch->state[task.aux] == InputFetch::QUEUED) {
+      RunFetch(lock, *task.fetch, task.aux);
     }
+  }
+}
 
-    // calculate spill amount (difference between rgb and raw despilled)
-    Vector3 spillVec = {
-        rgb[0] - rawDespilled.x,
-        rgb[1] - rawDespilled.y,
-        rgb[2] - rawDespilled.z,
-    };
+void DespillAPIop::DropPrefetch(std::unique_lock<std::mutex> &lock)
+{
+  // queued fetches are never run, running ones are waited for
+  for(FetchTask &task : _prefetchQueue) {
+    SkipFetch(*task.fetch);
+  }
+  _prefetchQueue.clear();
+  for(PrefetchSlot &slot : _prefetchRing) {
+    slot = PrefetchSlot();
+  }
+  _prefetchDone.wait(lock, [this]() { return _prefetchRunning == 0; });
+}
 
-    float spillLuma = color::GetLuma(spillVec, k_respillMath);
+void DespillAPIop::StopPrefetch()
+{
+  std::vector<std::thread> workers;
+  {
+    std::unique_lock<std::mutex> lock(_prefetchMutex);
+    DropPrefetch(lock);
+    _prefetchStop = true;
+    workers.swap(_prefetchWorkers);
+  }
+  _prefetchWake.notify_all();
+  for(std::thread &worker : workers) {
+    worker.join();
+  }
+}
 
-    // process key generation and normalization
-    Vector3 despilledRGB;
-    Vector4 spillFull;
-    float spillLumaFull;
+void DespillAPIop::SetInputs(const Row &source, const InputRows &rows, int x, int step,
+                             bool readAlpha, DespillImage &image) const
+{
+  for(int i = 0; i < 3; ++i) {
+    auto chan = static_cast<nuke::Channel>(i + 1);
+    image.source.channel[i] = source[chan] + x;
+    if(_params.colorConnected) {
+      image.color.channel[i] = rows.color[chan] + x;
+    }
+    if(_params.respillConnected || _params.respillBlur != Constants::BLUR_NONE) {
+      image.respill.channel[i] = rows.respill[chan] + x;
+    }
+  }
+  if(readAlpha) {
+    image.source.channel[3] = source[Chan_Alpha] + x;
+  }
+  image.source.pixelStride = image.color.pixelStride = image.respill.pixelStride = step;
 
-    if(!k_absMode) {
-      // relative mode: use calculated values
-      despilledRGB = {rawDespilled.x, rawDespilled.y, rawDespilled.z};
-      spillFull = Vector4(spillVec.x, spillVec.y, spillVec.z, 0.0f);
-      spillLumaFull = spillLuma;
+  if(rows.limitActive) {
+    image.limit.channel[0] = rows.limit[k_limitChannel] + x;
+    image.limit.pixelStride = step;
+  }
+  if(_kernel.HasPlans()) {
+    image.id.channel[0] = rows.id[k_idChannel] + x;
+    image.id.pixelStride = step;
+  }
+}
+
+void DespillAPIop::ProcessCPU(int y, int x, int r, ChannelMask channels, Row &row)
+{
+  // the work follows the requested channels: the spill matte alone skips the
+  // respill, rgb alone skips the source alpha, and none of the outputs of the node
+  // is a plain copy
+  Demand demand = ChannelDemand(channels);
+  if(!demand.rgb && !demand.matte && !demand.layers) {
+    row.get(input0(), y, x, r, channels);
+    return;
+  }
+  if(k_wedgeMode == Constants::WEDGE_SHEET) {
+    ProcessSheet(y, x, r, channels, row);
+    return;
+  }
+  if(_cacheReader.IsOpen() && !demand.layers) {
+    ProcessCached(y, x, r, channels, row);
+    return;
+  }
+
+  // auxiliary rows, fetched once for the main output and every wedge layer. with
+  // prefetch on a worker fetches them while the source row is read
+  std::shared_ptr<InputFetch> pending = QueueInputs(y, x, r, demand.rgb || demand.layers);
+
+  // get main input data
+  bool readAlpha = demand.matte || demand.layers;
+  nuke::ChannelSet requestedChannels = channels;
+  requestedChannels += Mask_RGB;
+  if(readAlpha) {
+    requestedChannels += Mask_Alpha;
+  }
+  row.get(input0(), y, x, r, requestedChannels);
+
+  // copy all non rgb channels
+  nuke::ChannelSet copyMask = channels - nuke::Mask_RGB;
+  row.pre_copy(row, copyMask);
+  row.copy(row, copyMask, x, r);
+
+  if(!WaitInputs(*pending)) {
+    return;
+  }
+  const InputRows &inputs = pending->rows;
+
+  // the row as a single line image for the kernel, input pointers are taken
+  // before the writable ones so the kernel works in place
+  DespillImage image = {};
+  image.width = r - x;
+  image.height = 1;
+  image.x = x;
+  image.y = y;
+  SetInputs(row, inputs, x, 1, readAlpha, image);
+  image.output.pixelStride = 1;
+
+  // wedge layers run first, the main output below overwrites the source rgb
+  for(size_t v = 0; v < _wedgeKernels.size() && demand.layers; v++) {
+    bool wanted = false;
+    for(int c = 0; c < 4; c++) {
+      wanted = wanted || channels.contains(_wedgeChannels[v][c]);
     }
-    else {
-      // absolute mode: normalize spill relative to pícked color
-      // calculate how much the pícked color would be despilled
-      Vector4 pickDespilled = color::Despill(
-          despillColor, hueShift, _clr, k_despillMath, limitResult, k_customWeight, k_protectTones,
-          k_protectColor, k_protectTolerance, k_protectEffect, k_protectFalloff);
-
-      Vector3 pickSpill = {
-          despillColor.x - pickDespilled.x,
-          despillColor.y - pickDespilled.y,
-          despillColor.z - pickDespilled.z,
-      };
-
-      float pickSpillLuma = color::GetLuma(pickSpill, k_respillMath);
-
-      // normalize current spill relative to picked color spill
-      spillLumaFull = (pickSpillLuma == 0.0f) ? 0.0f : spillLuma / pickSpillLuma;
-      Vector3 scaledSpill = despillColor * spillLumaFull;
-      spillFull = Vector4(scaledSpill.x, scaledSpill.y, scaledSpill.z, 0.0f);
-      despilledRGB = {rgb[0] - scaledSpill.x, rgb[1] - scaledSpill.y, rgb[2] - scaledSpill.z};
-      spillMatte = pickDespilled.w;
-    }
-
-    // calculate final respill color (replacement color for removed spill)
-    Vector3 respillBase = {k_respillColor[0], k_respillColor[1], k_respillColor[2]};
-    Vector3 respillInput = respillRgb;
-    Vector3 finalRespill =
-        isRespillConnected ? Vector3(respillInput.x, respillInput.y, respillInput.z) : respillBase;
-
-    // output type: despilled image or spill matte
-    Vector4 result;
-    if(k_outputType == Constants::OUTPUT_DESPILL) {
-      // output despilled image with respill color added back
-      float rangeLuma = color::LumaRange(spillLumaFull, k_blackPoint, k_whitePoint);
-      result = {despilledRGB.x + finalRespill.x * rangeLuma,
-                despilledRGB.y + finalRespill.y * rangeLuma,
-                despilledRGB.z + finalRespill.z * rangeLuma, 0.0f};
-      spillLumaFull = rangeLuma;
+    if(!wanted) {
+      continue;
     }
-    else {
-      result = spillFull;
+    DespillImage layer = image;
+    for(int c = 0; c < 4; c++) {
+      layer.output.channel[c] = row.writable(_wedgeChannels[v][c]) + x;
     }
+    _wedgeKernels[v].ProcessRow(layer, 0);
+  }
 
-    // determine alpha output value
-    if(!k_outputAlpha) {
-      // pass the original input alpha channel
-      spillMatte = *input_alpha;
+  if(!demand.rgb && !demand.matte) {
+    return;
+  }
+  for(int i = 0; i < 3 && demand.rgb; ++i) {
+    image.output.channel[i] = row.writable(static_cast<nuke::Channel>(i + 1)) + x;
+  }
+  if(demand.matte) {
+    image.output.channel[3] = row.writable(k_outputSpillChannel) + x;
+  }
+
+  // rows spanning the whole box feed the disk cache
+  const Box &box = info_.box();
+  bool cacheRow = _cacheWriter.IsActive() && (demand.rgb || k_outputAlpha) && x <= box.x() &&
+                  r >= box.r() && y >= box.y() && y < box.t();
+  Row spill_row(x, r);
+  if(cacheRow) {
+    for(int c = 0; c < 4; ++c) {
+      float *spillPtr = spill_row.writable(static_cast<nuke::Channel>(c + 1));
+      std::fill(spillPtr + x, spillPtr + r, 0.0f);
+      image.spillOut.channel[c] = spillPtr + x;
     }
-    else if(!k_invertAlpha) {
-      // output spill amount as alpha channel
-      spillMatte = spillLumaFull;
+    image.spillOut.pixelStride = 1;
+  }
+
+  _kernel.ProcessRow(image, 0);
+
+  if(cacheRow) {
+    const float *spillRows[4];
+    for(int c = 0; c < 4; ++c) {
+      spillRows[c] = spill_row[static_cast<nuke::Channel>(c + 1)] + box.x();
     }
-    else {
-      // output inverted spill amount as alpha channel
-      spillMatte = 1.0f - spillLumaFull;
+    _cacheWriter.AddRow(y, spillRows);
+  }
+}
+
+void DespillAPIop::ProcessCached(int y, int x, int r, ChannelMask channels, Row &row)
+{
+  Demand demand = ChannelDemand(channels);
+
+  // the source rgb is only read to remove the spill from it, the spill output is the
+  // estimate itself. the source alpha passes through when the spill alpha is off
+  bool readRgb = demand.rgb && k_outputType == Constants::OUTPUT_DESPILL;
+  bool readAlpha = demand.matte && !k_outputAlpha;
+  nuke::ChannelSet sourceChannels = channels;
+  sourceChannels -= Mask_RGB;
+  sourceChannels -= k_outputSpillChannel;
+  if(readRgb) {
+    sourceChannels += Mask_RGB;
+  }
+  if(readAlpha) {
+    sourceChannels += Mask_Alpha;
+  }
+  if(!sourceChannels.empty()) {
+    row.get(input0(), y, x, r, sourceChannels);
+  }
+
+  // copy the fetched non rgb channels
+  nuke::ChannelSet copyMask = sourceChannels - nuke::Mask_RGB;
+  row.pre_copy(row, copyMask);
+  row.copy(row, copyMask, x, r);
+
+  // only the respill is fetched, the estimate replaces the other inputs
+  InputRows inputs(x, r);
+  if(!FetchInputs(y, x, r, demand.rgb, false, inputs)) {
+    return;
+  }
+
+  Row spill_row(x, r);
+  float *spillPtr[4];
+  for(int c = 0; c < 4; ++c) {
+    spillPtr[c] = spill_row.writable(static_cast<nuke::Channel>(c + 1)) + x;
+  }
+  _cacheReader.ReadRow(y, x, r, spillPtr);
+
+  DespillImage image = {};
+  image.width = r - x;
+  image.height = 1;
+  image.x = x;
+  image.y = y;
+  for(int i = 0; i < 3; ++i) {
+    auto chan = static_cast<nuke::Channel>(i + 1);
+    // the rgb of the spill output is not read, the estimate stands in for it
+    image.source.channel[i] = readRgb ? row[chan] + x : spillPtr[i];
+    if(_params.respillConnected || _params.respillBlur != Constants::BLUR_NONE) {
+      image.respill.channel[i] = inputs.respill[chan] + x;
     }
+  }
+  if(readAlpha) {
+    image.source.channel[3] = row[Chan_Alpha] + x;
+  }
+  for(int c = 0; c < 4; ++c) {
+    image.spill.channel[c] = spillPtr[c];
+  }
+  image.source.pixelStride = image.respill.pixelStride = image.spill.pixelStride = 1;
 
-    // write alpha channel to specified output channel
-    foreach(z, channels) {
-      if(z == k_outputSpillChannel) {
-        *(row.writable(z) + x0) = clamp(spillMatte, 0.0f, 1.0f);  // output spill alpha
-      }
+  for(int i = 0; i < 3 && demand.rgb; ++i) {
+    image.output.channel[i] = row.writable(static_cast<nuke::Channel>(i + 1)) + x;
+  }
+  if(demand.matte) {
+    image.output.channel[3] = row.writable(k_outputSpillChannel) + x;
+  }
+  image.output.pixelStride = 1;
+
+  _kernel.ProcessRow(image, 0);
+}
+
+void DespillAPIop::ProcessSheet(int y, int x, int r, ChannelMask channels, Row &row)
+{
+  Demand demand = ChannelDemand(channels);
+
+  // other channels pass through, rgb and the spill channel are black between the
+  // tiles
+  row.get(input0(), y, x, r, channels);
+  nuke::Channel outChannels[4] = {Chan_Red, Chan_Green, Chan_Blue, k_outputSpillChannel};
+  float *outPtr[4] = {nullptr, nullptr, nullptr, nullptr};
+  for(int c = 0; c < 4; ++c) {
+    if(c < 3 ? demand.rgb : demand.matte) {
+      outPtr[c] = row.writable(outChannels[c]);
+      std::fill(outPtr[c] + x, outPtr[c] + r, 0.0f);
     }
+  }
 
-    // write RGB channels to output
-    for(int i = 0; i < 3; i++) {
-      *outPtr[i] = result[i];
+  // the tiles show the frame scaled down by the number of columns, tile row j counts
+  // from the top of the format
+  const Format &format = info_.format();
+  const int count = static_cast<int>(_wedgeKernels.size());
+  const int columns = _sheetColumns;
+  const int tileW = format.width() / columns;
+  const int tileH = format.height() / columns;
+  const int fromTop = format.t() - 1 - y;
+  if(tileW <= 0 || tileH <= 0 || fromTop < 0 || fromTop / tileH * columns >= count) {
+    return;
+  }
+  const int j = fromTop / tileH;
+  const int tileY = format.t() - (j + 1) * tileH;
+
+  // one fetch of the inputs for the whole tile row, every tile reads every
+  // columns-th pixel of it through the pixel stride
+  const int sy = format.y() + (y - tileY) * columns;
+  Row source(format.x(), format.r());
+  source.get(input0(), sy, format.x(), format.r(), Mask_RGBA);
+  InputRows inputs(format.x(), format.r());
+  if(!FetchInputs(sy, format.x(), format.r(), demand.rgb, true, inputs)) {
+    return;
+  }
+
+  for(int i = 0; i < columns && j * columns + i < count; ++i) {
+    const int tileX = format.x() + i * tileW;
+    const int x0 = MAX(x, tileX);
+    const int x1 = MIN(r, tileX + tileW);
+    if(x0 >= x1) {
+      continue;
     }
 
-    // move to next pixel channel
-    incrementPointers();
+    // positions are tile pixels, the spill points of the sheet kernels are scaled
+    DespillImage image = {};
+    image.width = x1 - x0;
+    image.height = 1;
+    image.x = x0 - tileX;
+    image.y = y - tileY;
+    SetInputs(source, inputs, format.x() + (x0 - tileX) * columns, columns, demand.matte, image);
+    for(int c = 0; c < 4; ++c) {
+      image.output.channel[c] = outPtr[c] ? outPtr[c] + x0 : nullptr;
+    }
+    image.output.pixelStride = 1;
+    _wedgeKernels[j * columns + i].ProcessRow(image, 0);
   }
 }
 
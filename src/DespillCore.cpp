@@ -0,0 +1,351 @@
+
+#include "include/DespillCore.h"
+
+#include <algorithm>
+#include <exception>
+#include <thread>
+#include <vector>
+
+#include "include/Blur.h"
+#include "include/Constants.h"
+#include "include/DespillKernel.h"
+
+namespace
+{
+  bool InRange(int value, int lo, int hi)
+  {
+    return value >= lo && value <= hi;
+  }
+
+  bool HasRgb(const DespillInput &input)
+  {
+    return input.channel[0] && input.channel[1] && input.channel[2];
+  }
+
+  bool ValidParams(const DespillParams *params)
+  {
+    if(!InRange(params->colorType, Constants::COLOR_RED, Constants::COLOR_POINTS) ||
+       !InRange(params->despillMath, Constants::DESPILL_AVERAGE, Constants::DESPILL_CUSTOM) ||
+       !InRange(params->respillMath, Constants::LUMA_REC709, Constants::LUMA_MAX) ||
+       !InRange(params->outputType, Constants::OUTPUT_DESPILL, Constants::OUTPUT_SPILL) ||
+       !InRange(params->respillBlur, Constants::BLUR_NONE, Constants::BLUR_GAUSSIAN)) {
+      return false;
+    }
+    if(params->respillBlur != Constants::BLUR_NONE &&
+       !(params->respillBlurSize >= 0.0f && params->respillBlurSize < 1e6f)) {
+      return false;
+    }
+    if(params->colorType == Constants::COLOR_POINTS &&
+       !InRange(params->pointCount, 0, DESPILL_MAX_POINTS)) {
+      return false;
+    }
+    return true;
+  }
+
+  bool ValidArguments(const DespillParams *params, const DespillImage *image)
+  {
+    if(!params || !image || image->width < 0 || image->height < 0 || !ValidParams(params)) {
+      return false;
+    }
+    // output rgb is all or nothing, without it only the spill alpha is written
+    const DespillOutput &output = image->output;
+    bool rgbOut = output.channel[0] && output.channel[1] && output.channel[2];
+    bool noRgbOut = !output.channel[0] && !output.channel[1] && !output.channel[2];
+    if(!HasRgb(image->source) || !(rgbOut || (noRgbOut && output.channel[3]))) {
+      return false;
+    }
+    // spill estimates have all four channels or none
+    for(int i = 1; i < 4; ++i) {
+      if(!image->spill.channel[i] != !image->spill.channel[0] ||
+         !image->spillOut.channel[i] != !image->spillOut.channel[0]) {
+        return false;
+      }
+    }
+    if(params->colorConnected && !HasRgb(image->color)) {
+      return false;
+    }
+    if(rgbOut && params->respillConnected && params->respillBlur == Constants::BLUR_NONE &&
+       !HasRgb(image->respill)) {
+      return false;
+    }
+    return true;
+  }
+
+  // runs task(i) for i in [0, count), the calling thread takes task 0 and any task
+  // whose thread could not be started. an exception of a task is rethrown once every
+  // thread is joined, none escapes a thread
+  template <typename TaskFn>
+  void RunTasks(int count, const TaskFn &task)
+  {
+    std::vector<std::exception_ptr> errors(count);
+    auto run = [&](int i) {
+      try {
+        task(i);
+      }
+      catch(...) {
+        errors[i] = std::current_exception();
+      }
+    };
+
+    std::vector<std::thread> workers;
+    workers.reserve(count - 1);
+    int started = 1;
+    try {
+      for(; started < count; ++started) {
+        workers.emplace_back(run, started);
+      }
+    }
+    catch(...) {
+      for(int i = started; i < count; ++i) {
+        run(i);
+      }
+    }
+    run(0);
+    for(std::thread &worker : workers) {
+      worker.join();
+    }
+    for(std::exception_ptr &error : errors) {
+      if(error) {
+        std::rethrow_exception(error);
+      }
+    }
+  }
+
+  // copies the source rgb to planes and blurs them for the respill, one plane per thread
+  void BlurSource(const DespillParams &params, const DespillImage &image, int threads,
+                  std::vector<float> &planes)
+  {
+    const int width = image.width;
+    const int height = image.height;
+    const ptrdiff_t size = static_cast<ptrdiff_t>(width) * height;
+    planes.resize(3 * size);
+
+    auto blurChannel = [&](int c) {
+      float *plane = planes.data() + c * size;
+      const float *in = image.source.channel[c];
+      for(int y = 0; y < height; ++y) {
+        const float *row = in + y * image.source.rowStride;
+        for(int x = 0; x < width; ++x) {
+          plane[static_cast<ptrdiff_t>(y) * width + x] = row[x * image.source.pixelStride];
+        }
+      }
+      blur::BlurPlane(plane, width, height, params.respillBlur, params.respillBlurSize);
+    };
+
+    const int tasks = std::max(1, std::min(3, threads));
+    RunTasks(tasks, [&](int t) {
+      for(int c = t; c < 3; c += tasks) {
+        blurChannel(c);
+      }
+    });
+  }
+
+  int ThreadCount(int threads, int height)
+  {
+    if(threads <= 0) {
+      threads = static_cast<int>(std::thread::hardware_concurrency());
+    }
+    return std::max(1, std::min(threads, height));
+  }
+
+  // calls rowFn(y0, y1) on contiguous row bands, the calling thread takes the first one
+  template <typename RowFn>
+  void RunBands(int height, int threads, const RowFn &rowFn)
+  {
+    if(threads <= 1 || height <= 1) {
+      rowFn(0, height);
+      return;
+    }
+
+    const int band = (height + threads - 1) / threads;
+    RunTasks((height + band - 1) / band,
+             [&](int t) { rowFn(t * band, std::min((t + 1) * band, height)); });
+  }
+
+  // describes the blurred source as the respill of target, when the blur is on and
+  // the respill is read at all
+  void PrepareBlur(const DespillParams &params, const DespillImage &image, bool readRespill,
+                   int threads, std::vector<float> &blurred, DespillImage &target)
+  {
+    if(params.respillBlur == Constants::BLUR_NONE || !readRespill) {
+      return;
+    }
+    BlurSource(params, image, threads, blurred);
+    const ptrdiff_t size = static_cast<ptrdiff_t>(image.width) * image.height;
+    despill_input_planar(&target.respill, blurred.data(), blurred.data() + size,
+                         blurred.data() + 2 * size, nullptr, image.width, 0);
+  }
+
+  int Process(const DespillParams *params, const DespillIdPlan *plans, int planCount,
+              const DespillImage *image, int threads)
+  {
+    if(!ValidArguments(params, image) || planCount < 0 || (planCount > 0 && !plans)) {
+      return DESPILL_ERROR_ARGUMENT;
+    }
+
+    // the plans share the respill, the limit and the blurred respill of the base
+    std::vector<DespillIdPlan> shared(plans, plans + planCount);
+    for(DespillIdPlan &plan : shared) {
+      plan.params.respillConnected = params->respillConnected;
+      plan.params.limitConnected = params->limitConnected;
+      plan.params.respillBlur = params->respillBlur;
+      plan.params.respillBlurSize = params->respillBlurSize;
+      if(!ValidParams(&plan.params) || (plan.params.colorConnected && !HasRgb(image->color))) {
+        return DESPILL_ERROR_ARGUMENT;
+      }
+    }
+    if(planCount > 0 && !image->id.channel[0]) {
+      return DESPILL_ERROR_ARGUMENT;
+    }
+
+    despill::PlanTable table;
+    table.Prepare(*params, shared.data(), planCount);
+    threads = ThreadCount(threads, image->height);
+
+    // the respill reads the blurred source, built before the output may overwrite it.
+    // the spill alpha alone does not need the respill
+    DespillImage target = *image;
+    std::vector<float> blurred;
+    PrepareBlur(*params, *image, image->output.channel[0] != nullptr, threads, blurred, target);
+
+    RunBands(target.height, threads, [&](int y0, int y1) {
+      for(int y = y0; y < y1; ++y) {
+        table.ProcessRow(target, y);
+      }
+    });
+    return DESPILL_OK;
+  }
+
+  // the entry points let no exception through the C interface, memory or threads
+  // running out is reported as a status
+  template <typename Fn>
+  int Guarded(const Fn &fn)
+  {
+    try {
+      return fn();
+    }
+    catch(...) {
+      return DESPILL_ERROR_RESOURCE;
+    }
+  }
+
+  int ProcessWedge(const DespillParams *params, int count, const DespillImage *image,
+                   const DespillOutput *outputs, int threads)
+  {
+    if(!params || !image || count <= 0 || !outputs) {
+      return DESPILL_ERROR_ARGUMENT;
+    }
+
+    // one target per variant, all reading the same inputs. the respill and limit
+    // inputs in use and the respill blur follow the first variant
+    std::vector<DespillImage> targets(count, *image);
+    std::vector<despill::Kernel> kernels(count);
+    bool readRespill = false;
+    for(int i = 0; i < count; ++i) {
+      DespillParams variant = params[i];
+      variant.respillConnected = params[0].respillConnected;
+      variant.limitConnected = params[0].limitConnected;
+      variant.respillBlur = params[0].respillBlur;
+      variant.respillBlurSize = params[0].respillBlurSize;
+      targets[i].output = outputs[i];
+      if(!ValidArguments(&variant, &targets[i])) {
+        return DESPILL_ERROR_ARGUMENT;
+      }
+      kernels[i].Prepare(variant);
+      readRespill = readRespill || outputs[i].channel[0];
+    }
+    threads = ThreadCount(threads, image->height);
+
+    // the blurred source is built once for every variant
+    std::vector<float> blurred;
+    DespillImage blurTarget = *image;
+    PrepareBlur(params[0], *image, readRespill, threads, blurred, blurTarget);
+    for(DespillImage &target : targets) {
+      target.respill = blurTarget.respill;
+    }
+
+    // every variant runs on a row before the next row is read, so the input rows are
+    // read from memory once and stay in cache for the other variants
+    RunBands(image->height, threads, [&](int y0, int y1) {
+      for(int y = y0; y < y1; ++y) {
+        for(int i = 0; i < count; ++i) {
+          kernels[i].ProcessRow(targets[i], y);
+        }
+      }
+    });
+    return DESPILL_OK;
+  }
+}  // namespace
+
+extern "C" {
+
+void despill_params_init(DespillParams *params)
+{
+  if(params) {
+    *params = despill::DefaultParams();
+  }
+}
+
+void despill_input_rgba(DespillInput *input, const float *rgba, int width, ptrdiff_t rowStride)
+{
+  for(int i = 0; i < 4; i++) {
+    input->channel[i] = rgba ? rgba + i : nullptr;
+  }
+  input->pixelStride = 4;
+  input->rowStride = rowStride ? rowStride : static_cast<ptrdiff_t>(width) * 4;
+}
+
+void despill_output_rgba(DespillOutput *output, float *rgba, int width, ptrdiff_t rowStride)
+{
+  for(int i = 0; i < 4; i++) {
+    output->channel[i] = rgba ? rgba + i : nullptr;
+  }
+  output->pixelStride = 4;
+  output->rowStride = rowStride ? rowStride : static_cast<ptrdiff_t>(width) * 4;
+}
+
+void despill_input_planar(DespillInput *input, const float *r, const float *g, const float *b,
+                          const float *a, int width, ptrdiff_t rowStride)
+{
+  input->channel[0] = r;
+  input->channel[1] = g;
+  input->channel[2] = b;
+  input->channel[3] = a;
+  input->pixelStride = 1;
+  input->rowStride = rowStride ? rowStride : width;
+}
+
+void despill_output_planar(DespillOutput *output, float *r, float *g, float *b, float *a,
+                           int width, ptrdiff_t rowStride)
+{
+  output->channel[0] = r;
+  output->channel[1] = g;
+  output->channel[2] = b;
+  output->channel[3] = a;
+  output->pixelStride = 1;
+  output->rowStride = rowStride ? rowStride : width;
+}
+
+int despill_process(const DespillParams *params, const DespillImage *image)
+{
+  return despill_process_parallel(params, image, 1);
+}
+
+int despill_process_parallel(const DespillParams *params, const DespillImage *image, int threads)
+{
+  return Guarded([&]() { return Process(params, nullptr, 0, image, threads); });
+}
+
+int despill_process_ids(const DespillParams *params, const DespillIdPlan *plans, int planCount,
+                        const DespillImage *image, int threads)
+{
+  return Guarded([&]() { return Process(params, plans, planCount, image, threads); });
+}
+
+int despill_process_wedge(const DespillParams *params, int count, const DespillImage *image,
+                          const DespillOutput *outputs, int threads)
+{
+  return Guarded([&]() { return ProcessWedge(params, count, image, outputs, threads); });
+}
+
+}  // extern "C"
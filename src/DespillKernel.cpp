@@ -0,0 +1,579 @@
+
+#include "include/DespillKernel.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "include/Constants.h"
+#include "include/Scan.h"
+
+namespace despill
+{
+  using color::Vector3;
+
+  DespillParams DefaultParams()
+  {
+    DespillParams params = {};
+    params.colorType = Constants::COLOR_PICK;
+    params.spillPick[0] = 0.0f;
+    params.spillPick[1] = 1.0f;
+    params.spillPick[2] = 0.0f;
+    params.despillMath = Constants::DESPILL_AVERAGE;
+    params.hueLimit = 1.0f;
+    params.invertLimit = 1;
+    params.protectTolerance = 0.2f;
+    params.protectFalloff = 2.0f;
+    params.protectEffect = 1.0f;
+    params.respillMath = Constants::LUMA_REC709;
+    params.respillColor[0] = 1.0f;
+    params.respillColor[1] = 1.0f;
+    params.respillColor[2] = 1.0f;
+    params.respillBlur = Constants::BLUR_NONE;
+    params.respillBlurSize = 20.0f;
+    params.blackPoint = 0.0f;
+    params.whitePoint = 1.0f;
+    params.outputType = Constants::OUTPUT_DESPILL;
+    params.outputAlpha = 1;
+    params.invertAlpha = 1;
+    return params;
+  }
+
+  void SpillGrid::Build(const DespillParams &params)
+  {
+    const int width = std::max(params.frameWidth, 1);
+    const int height = std::max(params.frameHeight, 1);
+    _columns = (width + kSpacing - 1) / kSpacing + 1;
+    _rows = (height + kSpacing - 1) / kSpacing + 1;
+    _nodes.assign(4 * static_cast<size_t>(_columns) * _rows, 0.0f);
+
+    const Vector3 red = color::VectorToPlane(Vector3(1.0f, 0.0f, 0.0f));
+    float *node = _nodes.data();
+    for(int j = 0; j < _rows; ++j) {
+      for(int i = 0; i < _columns; ++i, node += 4) {
+        // inverse distance weighted color of the points, the +1 keeps the weight
+        // finite on a point
+        Vector3 spill;
+        float weightSum = 0.0f;
+        for(int p = 0; p < params.pointCount; ++p) {
+          float dx = params.pointPosition[p][0] - i * kSpacing;
+          float dy = params.pointPosition[p][1] - j * kSpacing;
+          float weight = 1.0f / (dx * dx + dy * dy + 1.0f);
+          spill = spill + Vector3(params.pointColor[p]) * weight;
+          weightSum += weight;
+        }
+        spill = spill * (1.0f / weightSum);
+
+        // a gray node has no hue, it keeps the shift of red
+        Vector3 plane = color::VectorToPlane(spill);
+        float autoShift = plane.dot(plane) > 0.0f ? color::ColorAngle(plane, red) : 0.0f;
+        node[0] = autoShift * 180.0f / fastmath::kPi;  // rads to deg
+        node[1] = spill.x;
+        node[2] = spill.y;
+        node[3] = spill.z;
+      }
+    }
+  }
+
+  float SpillGrid::Sample(float fx, float fy, Vector3 *color) const
+  {
+    float gx = color::Clamp(fx / kSpacing, 0.0f, static_cast<float>(_columns - 1));
+    float gy = color::Clamp(fy / kSpacing, 0.0f, static_cast<float>(_rows - 1));
+    int i = std::min(static_cast<int>(gx), _columns - 2);
+    int j = std::min(static_cast<int>(gy), _rows - 2);
+    float tx = gx - i;
+    float ty = gy - j;
+
+    const float *n00 = _nodes.data() + 4 * (static_cast<size_t>(j) * _columns + i);
+    const float *n10 = n00 + 4;
+    const float *n01 = n00 + 4 * _columns;
+    const float *n11 = n01 + 4;
+    auto mix = [&](float v00, float v10, float v01, float v11) {
+      float top = v00 + (v10 - v00) * tx;
+      float bottom = v01 + (v11 - v01) * tx;
+      return top + (bottom - top) * ty;
+    };
+
+    // the hue shifts wrap at +-180, the corners are unwrapped around the first one
+    auto unwrap = [&](float shift) {
+      float d = shift - n00[0];
+      return d > 180.0f ? shift - 360.0f : (d < -180.0f ? shift + 360.0f : shift);
+    };
+    float shift = mix(n00[0], unwrap(n10[0]), unwrap(n01[0]), unwrap(n11[0]));
+
+    if(color) {
+      for(int k = 1; k < 4; ++k) {
+        (*color)[k - 1] = mix(n00[k], n10[k], n01[k], n11[k]);
+      }
+    }
+    return shift;
+  }
+
+  Kernel::Kernel()
+  {
+    Prepare(DefaultParams());
+  }
+
+  void Kernel::Prepare(const DespillParams &params)
+  {
+    _params = params;
+    _clr = 0;
+    _usePickedColor = 0;
+    _hueShift = 0.0f;
+    _hueRotation = color::MakeHueRotation(0.0f);
+    _bypass = false;
+    _usePoints = false;
+
+    // initialize normalization vector for colorspace calcs
+    Vector3 normVec(1.0f, 1.0f, 1.0f);
+
+    // get the picked spill color
+    Vector3 pickSpill(params.spillPick);
+
+    // determine color selection mode
+    if(params.colorConnected) {
+      // color input is connected:
+      // use automatic color detection
+      _clr = 0;             // red channel
+      _usePickedColor = 1;  // flag to use picked color
+    }
+    else if(params.colorType == Constants::COLOR_POINTS) {
+      // spill color interpolated from the spill points, no points passes through
+      _usePoints = params.pointCount > 0;
+      _bypass = !_usePoints;
+      if(_usePoints) {
+        _spillGrid.Build(params);
+      }
+    }
+    else if(params.colorType != Constants::COLOR_PICK) {
+      // manual channel selection (Red/Green/Blue butons)
+      _usePickedColor = 0;         // use channel selection, not picked color
+      _clr = params.colorType;     // use selected channel (0=Red, 1=Green, 2=Blue)
+    }
+    else if(pickSpill.x == pickSpill.y && pickSpill.x == pickSpill.z) {
+      // if picked color is grayscale (all rgb values equal)
+      // this means that no valid color was picked,
+      // so pass trought input unchanged
+      _bypass = true;
+    }
+    else {
+      // valid color was picked from picker knob
+      _usePickedColor = 1;  // use the picked color
+      _clr = 0;             // default processing channel
+    }
+
+    // calculate hue shift for non connected color mode
+    if(!params.colorConnected) {
+      float autoShift = 0.0f;
+
+      if(_usePickedColor == 1) {
+        // calculate automatic hue shift based on picked color
+        // convert picked color and red reference to plane vectors for angle calc
+        Vector3 v1 = color::VectorToPlane(pickSpill, normVec);
+        Vector3 v2 = color::VectorToPlane(Vector3(1.0f, 0.0f, 0.0f), normVec);  // red reference
+
+        // calculate angle between picked color and red reference
+        autoShift = color::ColorAngle(v1, v2);
+        autoShift = autoShift * 180.0f / fastmath::kPi;  // rads to deg
+      }
+
+      // final hue shift: user offset - automatic shift
+      // this allows user to fine-tune the calculated shift
+      _hueShift = params.hueOffset - autoShift;
+      _hueRotation = color::MakeHueRotation(_hueShift);
+
+      // spill color: the picked color, or a constant based on selected channel
+      _despillColor = _usePickedColor == 1 ? pickSpill
+                                           : Vector3(_clr == 0 ? 1.0f : 0.0f,
+                                                     _clr == 1 ? 1.0f : 0.0f,
+                                                     _clr == 2 ? 1.0f : 0.0f);
+    }
+
+    // despill strength is hueLimit * limit, it is zero wherever the limit matte
+    // holds _limitZero
+    _limitZero = params.invertLimit ? 1.0f : 0.0f;
+    _zeroStrength = params.hueLimit == 0.0f;
+
+    // a pixel with no spill keeps its rgb and gets the respill of a zero spill luma.
+    // the pre-test needs a row constant hue shift, and the protect preview always
+    // needs the protect weight
+    bool protectActive =
+        params.protectTones && (params.protectColor[0] != params.protectColor[1] ||
+                                params.protectColor[0] != params.protectColor[2]);
+    _spillTest = !_bypass && !params.colorConnected && !_usePoints &&
+                 !(params.protectPreview && params.protectTones) &&
+                 !(protectActive && params.protectEffect < 0.0f);
+    if(_spillTest) {
+      _spillTestSetup = color::MakeSpillTest(_hueShift, _clr, params.despillMath,
+                                             params.customWeight, protectActive);
+    }
+    _cleanLuma = params.outputType == Constants::OUTPUT_DESPILL
+                     ? color::LumaRange(0.0f, params.blackPoint, params.whitePoint)
+                     : 0.0f;
+    _cleanAlpha = params.invertAlpha ? 1.0f - _cleanLuma : _cleanLuma;
+
+    // knob state of the per pixel path
+    _pixelParams.clr = _clr;
+    _pixelParams.despillMath = params.despillMath;
+    _pixelParams.customWeight = params.customWeight;
+    _pixelParams.protectTones = params.protectTones != 0;
+    _pixelParams.protectPreview = params.protectPreview != 0;
+    for(int i = 0; i < 3; i++) {
+      _pixelParams.protectColor[i] = params.protectColor[i];
+    }
+    _pixelParams.protectExponent =
+        color::ProtectExponent(params.protectTolerance, params.protectFalloff);
+    _pixelParams.protectEffect = params.protectEffect;
+    _pixelParams.absMode = params.absMode != 0;
+    _pixelParams.respillMath = params.respillMath;
+    _pixelParams.blackPoint = params.blackPoint;
+    _pixelParams.whitePoint = params.whitePoint;
+    _pixelParams.outputType = params.outputType;
+    _pixelParams.outputAlpha = params.outputAlpha != 0;
+    _pixelParams.invertAlpha = params.invertAlpha != 0;
+  }
+
+  void Kernel::ProcessRow(const DespillImage &image, int y) const
+  {
+    ProcessSpan(image, y, 0, image.width);
+  }
+
+  void Kernel::ProcessSpan(const DespillImage &image, int y, int x, int r) const
+  {
+    const DespillInput &source = image.source;
+    const DespillOutput &output = image.output;
+    const ptrdiff_t inStride = source.pixelStride;
+    const ptrdiff_t outStride = output.pixelStride;
+
+    // row pointers of the rgb channels and the alphas. output rgb is absent when
+    // only the spill alpha is wanted, the respill is then never read
+    const bool writeRgb = output.channel[0] != nullptr;
+    const float *inPtr[3];
+    float *outPtr[3] = {nullptr, nullptr, nullptr};
+    for(int i = 0; i < 3; i++) {
+      inPtr[i] = source.channel[i] + y * source.rowStride;
+      if(writeRgb) {
+        outPtr[i] = output.channel[i] + y * output.rowStride;
+      }
+    }
+    const float *inAlpha = source.channel[3] ? source.channel[3] + y * source.rowStride : nullptr;
+    float *outAlpha = output.channel[3] ? output.channel[3] + y * output.rowStride : nullptr;
+
+    // case: no valid spill color, rgb passes through and the alpha is left as is
+    if(_bypass) {
+      for(int i = 0; i < 3 && writeRgb; i++) {
+        if(outPtr[i] == inPtr[i] && outStride == inStride) {
+          continue;
+        }
+        for(int x0 = x; x0 < r; ++x0) {
+          outPtr[i][x0 * outStride] = inPtr[i][x0 * inStride];
+        }
+      }
+      return;
+    }
+
+    // case: only the spill alpha is wanted and it does not depend on the despill,
+    // the source alpha is passed, or the alpha is left as is in protect preview. a
+    // wanted spill estimate still needs the despill
+    const bool preview = _params.protectPreview && _params.protectTones;
+    const bool estimateOut = image.spillOut.channel[0] && !preview;
+    if(!writeRgb && (preview || (!_params.outputAlpha && !estimateOut))) {
+      if(outAlpha && !preview) {
+        for(int x0 = x; x0 < r; ++x0) {
+          float inputAlpha = inAlpha ? inAlpha[x0 * inStride] : 1.0f;
+          outAlpha[x0 * outStride] = color::Clamp(inputAlpha, 0.0f, 1.0f);
+        }
+      }
+      return;
+    }
+
+    // auxiliary inputs, only read when connected
+    const float *colorPtr[3] = {nullptr, nullptr, nullptr};
+    const float *respillPtr[3] = {nullptr, nullptr, nullptr};
+    const bool respillBlur = _params.respillBlur != Constants::BLUR_NONE;
+    const bool readRespill = writeRgb && (_params.respillConnected || respillBlur);
+    for(int i = 0; i < 3; i++) {
+      if(_params.colorConnected) {
+        colorPtr[i] = image.color.channel[i] + y * image.color.rowStride;
+      }
+      if(readRespill) {
+        respillPtr[i] = image.respill.channel[i] + y * image.respill.rowStride;
+      }
+    }
+    const ptrdiff_t colorStride = image.color.pixelStride;
+    const ptrdiff_t respillStride = image.respill.pixelStride;
+
+    // respill color: knob value, the connected Respill input, or the blurred source
+    // tinted by the knob value
+    auto respillAt = [&](int x0) -> Vector3 {
+      Vector3 finalRespill(_params.respillColor);
+      if(readRespill && respillBlur) {
+        for(int i = 0; i < 3; i++) {
+          finalRespill[i] *= respillPtr[i][x0 * respillStride];
+        }
+      }
+      else if(readRespill) {
+        finalRespill =
+            Vector3(respillPtr[0][x0 * respillStride], respillPtr[1][x0 * respillStride],
+                    respillPtr[2][x0 * respillStride]);
+      }
+      return finalRespill;
+    };
+
+    // rows of the spill estimate, given in place of the despill or written out
+    const float *spillPtr[4] = {nullptr, nullptr, nullptr, nullptr};
+    float *spillOutPtr[4] = {nullptr, nullptr, nullptr, nullptr};
+    for(int i = 0; i < 4; i++) {
+      if(image.spill.channel[0] && !preview) {
+        spillPtr[i] = image.spill.channel[i] + y * image.spill.rowStride;
+      }
+      if(estimateOut) {
+        spillOutPtr[i] = image.spillOut.channel[i] + y * image.spillOut.rowStride;
+      }
+    }
+    const ptrdiff_t spillStride = image.spill.pixelStride;
+    const ptrdiff_t spillOutStride = image.spillOut.pixelStride;
+
+    // case: the spill estimate is given, only the respill and the output are composed
+    if(spillPtr[0]) {
+      for(int x0 = x; x0 < r; ++x0) {
+        Vector3 rgb(inPtr[0][x0 * inStride], inPtr[1][x0 * inStride], inPtr[2][x0 * inStride]);
+        float inputAlpha = inAlpha ? inAlpha[x0 * inStride] : 1.0f;
+        Vector3 spill(spillPtr[0][x0 * spillStride], spillPtr[1][x0 * spillStride],
+                      spillPtr[2][x0 * spillStride]);
+        float spillLuma = spillPtr[3][x0 * spillStride];
+
+        Vector3 result;
+        float spillMatte;
+        color::ComposePixel(_pixelParams, rgb - spill, spill, spillLuma, respillAt(x0),
+                            inputAlpha, result, spillMatte);
+        if(outAlpha) {
+          outAlpha[x0 * outStride] = color::Clamp(spillMatte, 0.0f, 1.0f);
+        }
+        for(int i = 0; i < 3 && writeRgb; i++) {
+          outPtr[i][x0 * outStride] = result[i];
+        }
+      }
+      return;
+    }
+
+    // a connected limit without a row has zero strength everywhere
+    const float *limitPtr = nullptr;
+    if(_params.limitConnected && image.limit.channel[0]) {
+      limitPtr = image.limit.channel[0] + y * image.limit.rowStride;
+    }
+    const ptrdiff_t limitStride = image.limit.pixelStride;
+    const bool limitRowActive = _params.limitConnected && !_zeroStrength && limitPtr;
+
+    // returns the end of the span starting at x0 where the strength is either zero
+    // or non-zero throughout
+    auto nextSpan = [&](int x0, bool &zeroSpan) -> int {
+      if(!limitRowActive) {
+        zeroSpan = _params.limitConnected || _zeroStrength;
+        return r;
+      }
+      zeroSpan = limitPtr[x0 * limitStride] == _limitZero;
+      return scan::FindRunEnd(limitPtr, limitStride, x0, r, _limitZero, zeroSpan);
+    };
+
+    // despill strength of a pixel inside a span
+    auto strengthAt = [&](int x0, bool zeroSpan) -> float {
+      if(zeroSpan) {
+        return 0.0f;
+      }
+      if(!_params.limitConnected) {
+        return _params.hueLimit;
+      }
+      float limit = limitPtr[x0 * limitStride];
+      float invertInputLimit = _params.invertLimit ? (1.0f - limit) : limit;
+      return _params.hueLimit * invertInputLimit;
+    };
+
+    // spill-free blocks are tested ahead of the pixel loop, pixels in [x0, cleanEnd)
+    // skip the hue rotations, luma and respill math
+    int testedEnd = x;
+    int cleanEnd = x;
+    float blockStrength[scan::kBlockSize];
+    const color::SpillFreeBlockFn spillFreeBlock =
+        _spillTest ? color::SelectSpillFreeBlock<scan::kBlockSize>(_spillTestSetup.despillMath,
+                                                                   inStride == 1)
+                   : nullptr;
+    const bool despillOut = _params.outputType == Constants::OUTPUT_DESPILL;
+
+    // Main pixel loop, walked span by span of uniform limit strength
+    for(int x0 = x; x0 < r;) {
+      bool zeroSpan;
+      int spanEnd = nextSpan(x0, zeroSpan);
+
+      for(; x0 < spanEnd; ++x0) {
+        // read rgb values from the current pixel
+        Vector3 rgb(inPtr[0][x0 * inStride], inPtr[1][x0 * inStride], inPtr[2][x0 * inStride]);
+        float inputAlpha = inAlpha ? inAlpha[x0 * inStride] : 1.0f;
+
+        Vector3 finalRespill = respillAt(x0);
+
+        // test the next block once the previous one is consumed
+        if(_spillTest && x0 >= testedEnd && x0 + scan::kBlockSize <= spanEnd) {
+          for(int j = 0; j < scan::kBlockSize; ++j) {
+            blockStrength[j] = strengthAt(x0 + j, zeroSpan);
+          }
+          testedEnd = x0 + scan::kBlockSize;
+          bool spillFree = spillFreeBlock(_spillTestSetup, inPtr[0] + x0 * inStride,
+                                          inPtr[1] + x0 * inStride, inPtr[2] + x0 * inStride,
+                                          inStride, blockStrength);
+          cleanEnd = spillFree ? testedEnd : x0;
+        }
+
+        Vector3 result;
+        float spillMatte = 0.0f;
+        bool writeAlpha = true;
+        Vector3 despilledRGB, spill;
+        float spillLuma = 0.0f;
+
+        if(x0 < cleanEnd) {
+          // case: no spill in this pixel, pass rgb through with a constant spill alpha
+          result = despillOut ? rgb + finalRespill * _cleanLuma : Vector3();
+          spillMatte = _params.outputAlpha ? _cleanAlpha : inputAlpha;
+        }
+        else {
+          // determine despill color and hue shift
+          Vector3 despillColor = _despillColor;
+          color::HueRotation rotation = _hueRotation;
+          if(_params.colorConnected) {
+            // use color from connected input for atm color detection
+            despillColor =
+                Vector3(colorPtr[0][x0 * colorStride], colorPtr[1][x0 * colorStride],
+                        colorPtr[2][x0 * colorStride]);
+            Vector3 v1 = color::VectorToPlane(despillColor);
+            Vector3 v2 = color::VectorToPlane(Vector3(1.0f, 0.0f, 0.0f));
+            float autoShift = color::ColorAngle(v1, v2);
+            autoShift = autoShift * 180.0f / fastmath::kPi;  // rad to deg
+            rotation = color::MakeHueRotation(_params.hueOffset - autoShift);
+          }
+          else if(_usePoints) {
+            // spill color of the grid at the pixel center, the color itself is only
+            // used by the abs mode
+            float autoShift =
+                _spillGrid.Sample(image.x + x0 + 0.5f, image.y + y + 0.5f,
+                                  _params.absMode ? &despillColor : nullptr);
+            rotation = color::MakeHueRotation(_params.hueOffset - autoShift);
+          }
+
+          // apply limit matte if connected
+          float limitResult = strengthAt(x0, zeroSpan);
+
+          if(preview) {
+            // protect preview: the rgb shows the protection, the alpha is left as is
+            writeAlpha = color::DespillPixel(_pixelParams, rgb, despillColor, rotation,
+                                             limitResult, zeroSpan, finalRespill, inputAlpha,
+                                             result, spillMatte);
+          }
+          else {
+            color::SpillPixel(_pixelParams, rgb, despillColor, rotation, limitResult, zeroSpan,
+                              despilledRGB, spill, spillLuma);
+            color::ComposePixel(_pixelParams, despilledRGB, spill, spillLuma, finalRespill,
+                                inputAlpha, result, spillMatte);
+          }
+        }
+
+        // write the spill estimate, zero for a pixel with no spill
+        if(spillOutPtr[0]) {
+          for(int i = 0; i < 3; i++) {
+            spillOutPtr[i][x0 * spillOutStride] = spill[i];
+          }
+          spillOutPtr[3][x0 * spillOutStride] = spillLuma;
+        }
+
+        // write alpha channel to the spill output
+        if(writeAlpha && outAlpha) {
+          outAlpha[x0 * outStride] = color::Clamp(spillMatte, 0.0f, 1.0f);
+        }
+
+        // write RGB channels to output
+        for(int i = 0; i < 3 && writeRgb; i++) {
+          outPtr[i][x0 * outStride] = result[i];
+        }
+      }
+    }
+  }
+
+  void PlanTable::Prepare(const DespillParams &base, const DespillIdPlan *plans, int count)
+  {
+    _base.Prepare(base);
+
+    // sorted by id, the first plan of a repeated id wins
+    std::vector<int> order;
+    for(int i = 0; i < count; ++i) {
+      order.push_back(i);
+    }
+    std::stable_sort(order.begin(), order.end(),
+                     [&](int a, int b) { return plans[a].id < plans[b].id; });
+
+    _ids.clear();
+    _plans.clear();
+    for(int i : order) {
+      if(!_ids.empty() && _ids.back() == plans[i].id) {
+        continue;
+      }
+      _ids.push_back(plans[i].id);
+      _plans.push_back(Kernel());
+      _plans.back().Prepare(plans[i].params);
+    }
+  }
+
+  bool PlanTable::Bypass() const
+  {
+    for(const Kernel &plan : _plans) {
+      if(!plan.Bypass()) {
+        return false;
+      }
+    }
+    return _base.Bypass();
+  }
+
+  bool PlanTable::ZeroStrength() const
+  {
+    for(const Kernel &plan : _plans) {
+      if(!plan.ZeroStrength()) {
+        return false;
+      }
+    }
+    return _base.ZeroStrength();
+  }
+
+  const Kernel &PlanTable::Lookup(float value) const
+  {
+    // ids are matched on the nearest integer, NaN matches no plan
+    float id = std::floor(value + 0.5f);
+    if(!(id == id)) {
+      return _base;
+    }
+    auto it = std::lower_bound(_ids.begin(), _ids.end(), id,
+                               [](int a, float b) { return static_cast<float>(a) < b; });
+    if(it == _ids.end() || static_cast<float>(*it) != id) {
+      return _base;
+    }
+    return _plans[it - _ids.begin()];
+  }
+
+  void PlanTable::ProcessRow(const DespillImage &image, int y) const
+  {
+    // no plans or no id row: the whole row uses the base plan
+    if(_plans.empty() || !image.id.channel[0]) {
+      _base.ProcessRow(image, y);
+      return;
+    }
+
+    // walk the runs of equal id, each run goes through its plan in one span
+    const float *idPtr = image.id.channel[0] + y * image.id.rowStride;
+    const ptrdiff_t idStride = image.id.pixelStride;
+    for(int x0 = 0; x0 < image.width;) {
+      float value = idPtr[x0 * idStride];
+      int x1 = x0 + 1;
+      while(x1 < image.width && idPtr[x1 * idStride] == value) {
+        ++x1;
+      }
+      Lookup(value).ProcessSpan(image, y, x0, x1);
+      x0 = x1;
+    }
+  }
+}  // namespace despill
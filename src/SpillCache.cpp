@@ -0,0 +1,414 @@
+
+#include "include/SpillCache.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <thread>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+#endif
+
+namespace spillcache
+{
+  namespace
+  {
+    const char kMagic[8] = {'D', 'S', 'P', 'L', 'C', 'C', 'H', '1'};
+    const uint32_t kVersion = 1;
+    const size_t kTileFloats = static_cast<size_t>(kTileSize) * kTileSize * kChannels;
+
+    int TilesAcross(int size)
+    {
+      return (size + kTileSize - 1) / kTileSize;
+    }
+
+    // offset in floats of pixel (px, py) of the box, channel c
+    size_t PixelOffset(int tilesX, int px, int py, int c)
+    {
+      size_t tile = static_cast<size_t>(py / kTileSize) * tilesX + px / kTileSize;
+      return tile * kTileFloats + static_cast<size_t>(c) * kTileSize * kTileSize +
+             static_cast<size_t>(py % kTileSize) * kTileSize + px % kTileSize;
+    }
+
+    bool SeekTo(std::FILE *file, uint64_t offset)
+    {
+#if defined(_WIN32)
+      return _fseeki64(file, static_cast<__int64>(offset), SEEK_SET) == 0;
+#else
+      return fseeko(file, static_cast<off_t>(offset), SEEK_SET) == 0;
+#endif
+    }
+
+    // rename over an existing file, which std::rename does not do on Windows
+    bool MoveOver(const std::string &from, const std::string &to)
+    {
+#if defined(_WIN32)
+      return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+      return std::rename(from.c_str(), to.c_str()) == 0;
+#endif
+    }
+
+    // the modification time of a cache file is its last use
+    void Touch(const std::string &path)
+    {
+#if defined(_WIN32)
+      HANDLE file = CreateFileA(path.c_str(), FILE_WRITE_ATTRIBUTES,
+                                FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+                                OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+      if(file == INVALID_HANDLE_VALUE) {
+        return;
+      }
+      FILETIME now;
+      GetSystemTimeAsFileTime(&now);
+      SetFileTime(file, nullptr, nullptr, &now);
+      CloseHandle(file);
+#else
+      utime(path.c_str(), nullptr);
+#endif
+    }
+
+    struct CacheFile {
+      std::string path;
+      uint64_t size;
+      uint64_t time;
+    };
+
+    bool IsCacheName(const std::string &name)
+    {
+      static const std::string prefix = "despill_", suffix = ".dspc";
+      return name.size() > prefix.size() + suffix.size() &&
+             name.compare(0, prefix.size(), prefix) == 0 &&
+             name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0;
+    }
+
+    // the cache files of directory, temporary files of writers are left alone
+    std::vector<CacheFile> ListCache(const std::string &directory)
+    {
+      std::vector<CacheFile> files;
+#if defined(_WIN32)
+      WIN32_FIND_DATAA entry;
+      HANDLE find = FindFirstFileA((directory + "\\despill_*.dspc").c_str(), &entry);
+      if(find == INVALID_HANDLE_VALUE) {
+        return files;
+      }
+      do {
+        if(!(entry.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && IsCacheName(entry.cFileName)) {
+          CacheFile file;
+          file.path = directory + "\\" + entry.cFileName;
+          file.size = (static_cast<uint64_t>(entry.nFileSizeHigh) << 32) | entry.nFileSizeLow;
+          file.time = (static_cast<uint64_t>(entry.ftLastWriteTime.dwHighDateTime) << 32) |
+                      entry.ftLastWriteTime.dwLowDateTime;
+          files.push_back(file);
+        }
+      } while(FindNextFileA(find, &entry));
+      FindClose(find);
+#else
+      DIR *dir = opendir(directory.c_str());
+      if(!dir) {
+        return files;
+      }
+      while(struct dirent *entry = readdir(dir)) {
+        struct stat info;
+        CacheFile file;
+        file.path = directory + "/" + entry->d_name;
+        if(IsCacheName(entry->d_name) && stat(file.path.c_str(), &info) == 0 &&
+           S_ISREG(info.st_mode)) {
+          file.size = static_cast<uint64_t>(info.st_size);
+          file.time = static_cast<uint64_t>(info.st_mtime);
+          files.push_back(file);
+        }
+      }
+      closedir(dir);
+#endif
+      return files;
+    }
+
+    // deletes the least recently used cache files next to keep until the directory
+    // holds at most cap bytes of them. keep itself stays
+    void TrimCache(const std::string &keep, uint64_t cap)
+    {
+      size_t slash = keep.find_last_of("/\\");
+      std::string directory = slash == std::string::npos
+                                  ? std::string(".")
+                                  : keep.substr(0, std::max<size_t>(slash, 1));
+      std::vector<CacheFile> files = ListCache(directory);
+      uint64_t total = 0;
+      for(const CacheFile &file : files) {
+        total += file.size;
+      }
+      std::sort(files.begin(), files.end(),
+                [](const CacheFile &a, const CacheFile &b) { return a.time < b.time; });
+      const std::string keepName = keep.substr(slash == std::string::npos ? 0 : slash + 1);
+      for(const CacheFile &file : files) {
+        if(total <= cap) {
+          break;
+        }
+        const std::string name = file.path.substr(file.path.find_last_of("/\\") + 1);
+        if(name != keepName && std::remove(file.path.c_str()) == 0) {
+          total -= file.size;
+        }
+      }
+    }
+  }  // namespace
+
+  std::string CachePath(const std::string &directory, uint64_t key)
+  {
+    char name[32];
+    std::snprintf(name, sizeof(name), "despill_%016llx.dspc",
+                  static_cast<unsigned long long>(key));
+    if(directory.empty() || directory.back() == '/' || directory.back() == '\\') {
+      return directory + name;
+    }
+    return directory + "/" + name;
+  }
+
+  Reader::~Reader()
+  {
+    Close();
+  }
+
+  bool Reader::Open(const std::string &path, uint64_t key, int x, int y, int width, int height)
+  {
+    Close();
+    if(width <= 0 || height <= 0) {
+      return false;
+    }
+
+#if defined(_WIN32)
+    // shared for delete, so a writer can replace or trim the file while it is mapped
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
+                              nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if(file == INVALID_HANDLE_VALUE) {
+      return false;
+    }
+    LARGE_INTEGER size;
+    HANDLE mapping = nullptr;
+    const void *data = nullptr;
+    if(GetFileSizeEx(file, &size)) {
+      mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    }
+    if(mapping) {
+      data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    }
+    if(!data) {
+      if(mapping) {
+        CloseHandle(mapping);
+      }
+      CloseHandle(file);
+      return false;
+    }
+    _file = file;
+    _mapping = mapping;
+    _data = static_cast<const unsigned char *>(data);
+    _size = static_cast<size_t>(size.QuadPart);
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0) {
+      return false;
+    }
+    struct stat info;
+    void *data = MAP_FAILED;
+    if(fstat(fd, &info) == 0 && info.st_size > 0) {
+      data = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if(data == MAP_FAILED) {
+      return false;
+    }
+    _data = static_cast<const unsigned char *>(data);
+    _size = static_cast<size_t>(info.st_size);
+#endif
+
+    // the file must hold key for this box, in full
+    std::memcpy(&_header, _data, std::min(_size, sizeof(Header)));
+    _tilesX = TilesAcross(width);
+    size_t expected = sizeof(Header) + static_cast<size_t>(_tilesX) * TilesAcross(height) *
+                                           kTileFloats * sizeof(float);
+    if(_size != expected || std::memcmp(_header.magic, kMagic, sizeof(kMagic)) != 0 ||
+       _header.version != kVersion || _header.tileSize != kTileSize || _header.key != key ||
+       _header.x != x || _header.y != y || _header.width != width || _header.height != height) {
+      Close();
+      return false;
+    }
+    Touch(path);
+    return true;
+  }
+
+  void Reader::Close()
+  {
+    if(!_data) {
+      return;
+    }
+#if defined(_WIN32)
+    UnmapViewOfFile(_data);
+    CloseHandle(static_cast<HANDLE>(_mapping));
+    CloseHandle(static_cast<HANDLE>(_file));
+    _file = _mapping = nullptr;
+#else
+    munmap(const_cast<unsigned char *>(_data), _size);
+#endif
+    _data = nullptr;
+    _size = 0;
+  }
+
+  void Reader::ReadRow(int y, int x, int r, float *const channel[kChannels]) const
+  {
+    const float *tiles = reinterpret_cast<const float *>(_data + sizeof(Header));
+    const int py = std::max(std::min(y - _header.y, _header.height - 1), 0);
+    for(int c = 0; c < kChannels; ++c) {
+      for(int x0 = x; x0 < r; ++x0) {
+        const int px = std::max(std::min(x0 - _header.x, _header.width - 1), 0);
+        channel[c][x0 - x] = tiles[PixelOffset(_tilesX, px, py, c)];
+      }
+    }
+  }
+
+  Writer::~Writer()
+  {
+    Discard();
+  }
+
+  void Writer::Reset(const std::string &path, uint64_t key, int x, int y, int width, int height,
+                     uint64_t capBytes)
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    Discard();
+    _path = width > 0 && height > 0 ? path : std::string();
+    std::memcpy(_header.magic, kMagic, sizeof(kMagic));
+    _header.version = kVersion;
+    _header.tileSize = kTileSize;
+    _header.x = x;
+    _header.y = y;
+    _header.width = width;
+    _header.height = height;
+    _header.key = key;
+    _cap = capBytes;
+    _tilesX = TilesAcross(width);
+    _bandCount = _path.empty() ? 0 : TilesAcross(height);
+    _rowsDone = 0;
+    _rowDone.assign(_path.empty() ? 0 : height, 0);
+    _bands.clear();
+
+    // the file is named after the writer and its process, frames of the same key
+    // rendered elsewhere do not share it
+    std::lock_guard<std::mutex> fileGuard(_fileLock);
+    _target = _path;
+    _temp.clear();
+    if(!_path.empty()) {
+#if defined(_WIN32)
+      unsigned long process = GetCurrentProcessId();
+#else
+      unsigned long process = static_cast<unsigned long>(getpid());
+#endif
+      char suffix[48];
+      std::snprintf(suffix, sizeof(suffix), ".%lx.%zx.tmp", process,
+                    reinterpret_cast<size_t>(this));
+      _temp = _path + suffix;
+    }
+  }
+
+  void Writer::AddRow(int y, const float *const channel[kChannels])
+  {
+    // a row is a small copy next to its despill, it is taken under the lock. the
+    // band it completes is written after the lock is let go
+    std::vector<float> tiles;
+    int band;
+    {
+      std::lock_guard<std::mutex> guard(_lock);
+      const int py = y - _header.y;
+      if(_path.empty() || py < 0 || py >= _header.height || _rowDone[py]) {
+        return;
+      }
+      band = py / kTileSize;
+      Band &rows = _bands[band];
+      if(rows.tiles.empty()) {
+        rows.tiles.resize(static_cast<size_t>(_tilesX) * kTileFloats);
+      }
+      for(int c = 0; c < kChannels; ++c) {
+        for(int px = 0; px < _header.width; ++px) {
+          rows.tiles[PixelOffset(_tilesX, px, py % kTileSize, c)] = channel[c][px];
+        }
+      }
+      _rowDone[py] = 1;
+      if(++_rowsDone == _header.height) {
+        _path.clear();
+      }
+      if(++rows.rows < std::min(kTileSize, _header.height - band * kTileSize)) {
+        return;
+      }
+      tiles.swap(rows.tiles);
+      _bands.erase(band);
+    }
+    WriteBand(band, tiles);
+  }
+
+  bool Writer::WriteBand(int band, const std::vector<float> &tiles)
+  {
+    // the bands land in the file in any order, the header is written with the last.
+    // a failed write drops the frame
+    std::lock_guard<std::mutex> guard(_fileLock);
+    if(_failed || _temp.empty()) {
+      return false;
+    }
+    if(!_file) {
+      _file = std::fopen(_temp.c_str(), "wb");
+      if(!_file) {
+        _failed = true;
+        return false;
+      }
+    }
+    const uint64_t offset =
+        sizeof(Header) + static_cast<uint64_t>(band) * tiles.size() * sizeof(float);
+    if(!SeekTo(_file, offset) ||
+       std::fwrite(tiles.data(), sizeof(float), tiles.size(), _file) != tiles.size()) {
+      _failed = true;
+      return false;
+    }
+    if(++_bandsWritten < _bandCount) {
+      return true;
+    }
+    return Finish();
+  }
+
+  bool Writer::Finish()
+  {
+    // written next to the target and renamed, readers never see a partial file
+    bool written = SeekTo(_file, 0) && std::fwrite(&_header, sizeof(Header), 1, _file) == 1;
+    written = std::fclose(_file) == 0 && written;
+    _file = nullptr;
+    if(!written || !MoveOver(_temp, _target)) {
+      std::remove(_temp.c_str());
+      _failed = true;
+      return false;
+    }
+    _temp.clear();
+    if(_cap > 0) {
+      TrimCache(_target, _cap);
+    }
+    return true;
+  }
+
+  void Writer::Discard()
+  {
+    // a file left unfinished is removed
+    std::lock_guard<std::mutex> guard(_fileLock);
+    if(_file) {
+      std::fclose(_file);
+      _file = nullptr;
+      std::remove(_temp.c_str());
+    }
+    _temp.clear();
+    _bandsWritten = 0;
+    _failed = false;
+  }
+}  // namespace spillcache
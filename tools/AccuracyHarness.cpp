@@ -0,0 +1,442 @@
+// Accuracy harness for the despill kernels.
+//
+// Sweeps HDR input ranges and every knob mode, runs the float kernels of Color.h with
+// each math tier of FastMath.h and reports the maximum and mean absolute and relative
+// error against the double precision reference in Reference.h. The Fast and LUT
+// tiers are gated on the full pixel path against the Exact float tier, with a fixed
+// budget per input range, and timed against it on the pixel paths that use the tier
+// math. Exits non-zero when a tier goes over its budget. The kernel only runs the
+// Exact tier, a tier has to pass here and come out faster before it is offered.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "include/Color.h"
+#include "include/Constants.h"
+#include "include/Reference.h"
+
+namespace
+{
+  using color::Vector3;
+  using color::Vector4;
+
+  // samples below this magnitude only count towards the absolute error
+  const double kRelativeFloor = 1e-3;
+
+  // smallest absolute mode normalization luma that is measured
+  const double kConditionFloor = 1e-2;
+
+
+  struct ErrorStats {
+    double maxAbs = 0.0;
+    double sumAbs = 0.0;
+    double maxRel = 0.0;
+    double sumRel = 0.0;
+    double maxScaled = 0.0;  // |a - b| / max(1, |b|, scale)
+    long count = 0;
+    long relCount = 0;
+
+    void Add(double value, double ref, double scale = 1.0)
+    {
+      if(std::isnan(ref) || std::isinf(ref)) {
+        return;
+      }
+      double abs = std::isnan(value) ? HUGE_VAL : std::fabs(value - ref);
+      maxAbs = std::max(maxAbs, abs);
+      sumAbs += abs;
+      maxScaled = std::max(maxScaled, abs / std::max({1.0, std::fabs(ref), scale}));
+      ++count;
+
+      if(std::fabs(ref) >= kRelativeFloor) {
+        double rel = abs / std::fabs(ref);
+        maxRel = std::max(maxRel, rel);
+        sumRel += rel;
+        ++relCount;
+      }
+    }
+
+    void Add(const Vector3 &value, const reference::Vec3d &ref, double scale = 1.0)
+    {
+      for(int i = 0; i < 3; i++) {
+        Add(value[i], ref[i], scale);
+      }
+    }
+
+    void Print(const char *kernel) const
+    {
+      std::printf("  %-14s max abs %.3e  mean abs %.3e  max rel %.3e  mean rel %.3e\n", kernel,
+                  maxAbs, count ? sumAbs / count : 0.0, maxRel,
+                  relCount ? sumRel / relCount : 0.0);
+    }
+  };
+
+  // budget is the largest error of the pixel path of the Fast and LUT tiers against
+  // the Exact tier, relative to the magnitude of the pixel: the hue rotations mix
+  // the channels, so a channel that cancels out, and the spill alpha taken from the
+  // spill luma, keep the rounding of the largest channel
+  struct InputRange {
+    const char *name;
+    float lo;
+    float hi;
+    bool logarithmic;
+    double budget;
+  };
+
+  const InputRange kRanges[] = {
+      {"display [0, 1]", 0.0f, 1.0f, false, 2e-4},
+      {"hdr [0, 16]", 0.0f, 16.0f, false, 2e-4},
+      {"hdr log [1e-4, 1e4]", 1e-4f, 1e4f, true, 2e-4},
+      {"negative [-1, 4]", -1.0f, 4.0f, false, 2e-4},
+  };
+
+  struct Harness {
+    std::mt19937 rng{0x5eed};
+
+    float Uniform(float lo, float hi)
+    {
+      return std::uniform_real_distribution<float>(lo, hi)(rng);
+    }
+
+    float Sample(const InputRange &range)
+    {
+      if(!range.logarithmic) {
+        return Uniform(range.lo, range.hi);
+      }
+      return std::exp(Uniform(std::log(range.lo), std::log(range.hi)));
+    }
+
+    // saturated despill color, far enough from gray for a well conditioned hue angle
+    Vector3 SpillColor(int clr)
+    {
+      Vector3 c(Uniform(0.0f, 0.4f), Uniform(0.0f, 0.4f), Uniform(0.0f, 0.4f));
+      c[clr] = Uniform(0.6f, 1.0f);
+      return c;
+    }
+  };
+
+  reference::Vec3d ToRef(const Vector3 &v)
+  {
+    return reference::Vec3d(v.x, v.y, v.z);
+  }
+
+  struct TierStats {
+    ErrorStats hueRotate;
+    ErrorStats colorAngle;
+    ErrorStats despill;
+    ErrorStats lumaRange;
+    ErrorStats pixel;
+    ErrorStats pixelExact;  // pixel path against the Exact tier
+  };
+
+  // one tier over the samples of a range, every kernel against the reference and the
+  // pixel path against the Exact tier
+  template <typename Tier>
+  void MeasureTier(const InputRange &range, int samples, TierStats &stats)
+  {
+    Harness h;
+    for(int i = 0; i < samples; i++) {
+      // every knob mode is visited by cycling the sample index through them
+      int clr = i % 3;
+      int despillMath = (i / 3) % 4;
+      int respillMath = (i / 12) % 5;
+      bool absMode = (i / 60) % 2;
+      bool protectTones = (i / 120) % 2;
+      bool protectPreview = protectTones && (i / 240) % 4 == 0;
+      int outputType = (i / 960) % 2;
+      bool colorConnected = (i / 1920) % 2;
+      bool invertAlpha = (i / 3840) % 2;
+      bool rangedLuma = (i / 7680) % 2;
+
+      color::PixelParams p;
+      p.clr = clr;
+      p.despillMath = despillMath;
+      p.customWeight = h.Uniform(-1.0f, 1.0f);
+      p.protectTones = protectTones;
+      p.protectPreview = protectPreview;
+      p.protectColor[0] = h.Uniform(0.5f, 1.0f);
+      p.protectColor[1] = h.Uniform(0.2f, 0.6f);
+      p.protectColor[2] = h.Uniform(0.0f, 0.4f);
+      float protectTolerance = h.Uniform(0.05f, 1.0f);
+      p.protectEffect = h.Uniform(0.0f, 10.0f);
+      float protectFalloff = h.Uniform(0.0f, 4.0f);
+      p.protectExponent = color::ProtectExponent(protectTolerance, protectFalloff);
+      p.absMode = absMode;
+      p.respillMath = respillMath;
+      p.blackPoint = rangedLuma ? h.Uniform(0.0f, 0.4f) : 0.0f;
+      p.whitePoint = rangedLuma ? h.Uniform(0.6f, 1.0f) : 1.0f;
+      p.outputType = outputType;
+      p.outputAlpha = true;
+      p.invertAlpha = invertAlpha;
+
+      reference::PixelParams rp;
+      rp.clr = p.clr;
+      rp.despillMath = p.despillMath;
+      rp.customWeight = p.customWeight;
+      rp.protectTones = p.protectTones;
+      rp.protectPreview = p.protectPreview;
+      rp.protectColor = reference::Vec3d(p.protectColor[0], p.protectColor[1], p.protectColor[2]);
+      rp.protectTolerance = protectTolerance;
+      rp.protectEffect = p.protectEffect;
+      rp.protectFalloff = protectFalloff;
+      rp.absMode = p.absMode;
+      rp.respillMath = p.respillMath;
+      rp.blackPoint = p.blackPoint;
+      rp.whitePoint = p.whitePoint;
+      rp.outputType = p.outputType;
+      rp.outputAlpha = p.outputAlpha;
+      rp.invertAlpha = p.invertAlpha;
+
+      Vector3 rgb(h.Sample(range), h.Sample(range), h.Sample(range));
+      Vector3 respill(h.Uniform(0.0f, 4.0f), h.Uniform(0.0f, 4.0f), h.Uniform(0.0f, 4.0f));
+      float limit = h.Uniform(0.0f, 2.0f);
+      float hueOffset = h.Uniform(-30.0f, 30.0f);
+
+      // hue shift, from a per pixel color as with the Color input or a channel constant
+      Vector3 despillColor = h.SpillColor(clr);
+      float hueShift = hueOffset;
+      double refHueShift = hueOffset;
+      if(colorConnected) {
+        Vector3 v1 = color::VectorToPlane(despillColor);
+        Vector3 v2 = color::VectorToPlane(Vector3(1.0f, 0.0f, 0.0f));
+        float angle = color::ColorAngle<Tier>(v1, v2);
+        double refAngle = reference::ColorAngle(reference::VectorToPlane(ToRef(despillColor)),
+                                                reference::VectorToPlane(
+                                                    reference::Vec3d(1.0, 0.0, 0.0)));
+        stats.colorAngle.Add(angle, refAngle);
+
+        // the kernels below are measured from the same hue shift, acos conditioning
+        // near a zero angle is reported on its own by the ColorAngle line
+        hueShift = hueOffset - angle * 180.0f / fastmath::kPi;
+        refHueShift = hueShift;
+        p.clr = rp.clr = Constants::COLOR_RED;
+      }
+
+      color::HueRotation rotation = color::MakeHueRotation<Tier>(hueShift);
+      stats.hueRotate.Add(color::HueRotate(rgb, rotation),
+                          reference::HueRotate(ToRef(rgb), refHueShift));
+
+      Vector4 despilled = color::Despill<Tier>(rgb, rotation, p.clr, despillMath, limit,
+                                               p.customWeight, protectTones,
+                                               Vector3(p.protectColor), p.protectExponent,
+                                               p.protectEffect);
+      reference::Vec4d refDespilled = reference::Despill(
+          ToRef(rgb), refHueShift, rp.clr, despillMath, limit, rp.customWeight, protectTones,
+          rp.protectColor, rp.protectTolerance, rp.protectEffect, rp.protectFalloff);
+      stats.despill.Add(Vector3(despilled.x, despilled.y, despilled.z),
+                        reference::Vec3d(refDespilled.x, refDespilled.y, refDespilled.z));
+
+      float luma = h.Sample(range);
+      stats.lumaRange.Add(color::LumaRange(luma, p.blackPoint, p.whitePoint),
+                          reference::LumaRange(luma, rp.blackPoint, rp.whitePoint));
+
+      // absolute mode divides by the spill luma of the despill color, skip samples
+      // where that is close to zero since any rounding there is amplified
+      if(absMode) {
+        reference::Vec4d pick = reference::Despill(
+            ToRef(despillColor), refHueShift, rp.clr, despillMath, limit, rp.customWeight,
+            protectTones, rp.protectColor, rp.protectTolerance, rp.protectEffect,
+            rp.protectFalloff);
+        reference::Vec3d pickSpill =
+            ToRef(despillColor) - reference::Vec3d(pick.x, pick.y, pick.z);
+        if(std::fabs(reference::GetLuma(pickSpill, respillMath)) < kConditionFloor) {
+          continue;
+        }
+      }
+
+      Vector3 out;
+      float outAlpha = 0.0f;
+      reference::Vec3d refOut;
+      double refAlpha = 0.0;
+      bool alpha = color::DespillPixel<Tier>(p, rgb, despillColor, rotation, limit, false,
+                                             respill, 1.0f, out, outAlpha);
+      reference::DespillPixel(rp, ToRef(rgb), ToRef(despillColor), refHueShift, limit,
+                              ToRef(respill), 1.0, refOut, refAlpha);
+      stats.pixel.Add(out, refOut);
+      if(alpha) {
+        stats.pixel.Add(color::Clamp(outAlpha, 0.0f, 1.0f), reference::Clamp(refAlpha, 0.0, 1.0));
+      }
+
+      // the same pixel through the Exact tier, hue shift included. both share the
+      // float rounding, what is left is the error of the approximations
+      float exactShift = hueOffset;
+      if(colorConnected) {
+        Vector3 v1 = color::VectorToPlane(despillColor);
+        Vector3 v2 = color::VectorToPlane(Vector3(1.0f, 0.0f, 0.0f));
+        float angle = color::ColorAngle(v1, v2);
+        exactShift = hueOffset - angle * 180.0f / fastmath::kPi;
+      }
+      Vector3 exactOut;
+      float exactAlpha = 0.0f;
+      color::DespillPixel(p, rgb, despillColor, color::MakeHueRotation(exactShift), limit, false,
+                          respill, 1.0f, exactOut, exactAlpha);
+      double magnitude = std::max({std::fabs(rgb.x), std::fabs(rgb.y), std::fabs(rgb.z)});
+      stats.pixelExact.Add(out, ToRef(exactOut), magnitude);
+      if(alpha) {
+        stats.pixelExact.Add(color::Clamp(outAlpha, 0.0f, 1.0f),
+                             color::Clamp(exactAlpha, 0.0f, 1.0f), magnitude);
+      }
+    }
+  }
+}  // namespace
+
+namespace
+{
+  enum Tier { TIER_EXACT, TIER_FAST, TIER_LUT, TIER_COUNT };
+  const char *const kTierNames[] = {"Exact", "Fast", "LUT"};
+
+  // pixels of a throughput pass, the best of the passes is kept
+  const int kThroughputPixels = 1 << 16;
+  const int kThroughputPasses = 15;
+
+  // ns per pixel of the two paths that use the tier math, the picked color with tone
+  // protection (a pow per pixel) and the connected Color input (an acos and a hue
+  // rotation per pixel), measured as the kernel runs them
+  struct Throughput {
+    double pick;
+    double color;
+  };
+
+  template <typename Tier>
+  Throughput MeasureThroughput(const std::vector<Vector3> &pixels,
+                               const std::vector<Vector3> &colors, const color::PixelParams &p)
+  {
+    typedef std::chrono::steady_clock Clock;
+    const Vector3 red = color::VectorToPlane(Vector3(1.0f, 0.0f, 0.0f));
+    const Vector3 pick(0.2f, 0.8f, 0.3f);
+    Throughput best = {HUGE_VAL, HUGE_VAL};
+    volatile float sink = 0.0f;
+
+    for(int pass = 0; pass < kThroughputPasses; pass++) {
+      Vector3 despilled, spill;
+      float luma = 0.0f;
+      float sum = 0.0f;
+
+      Clock::time_point start = Clock::now();
+      color::HueRotation rotation = color::MakeHueRotation<Tier>(
+          -color::ColorAngle<Tier>(color::VectorToPlane(pick), red) * 180.0f / fastmath::kPi);
+      for(size_t i = 0; i < pixels.size(); i++) {
+        color::SpillPixel<Tier>(p, pixels[i], pick, rotation, 1.0f, false, despilled, spill,
+                                luma);
+        sum += despilled.y + luma;
+      }
+      Clock::time_point middle = Clock::now();
+      for(size_t i = 0; i < pixels.size(); i++) {
+        float angle = color::ColorAngle<Tier>(color::VectorToPlane(colors[i]), red);
+        color::SpillPixel<Tier>(
+            p, pixels[i], colors[i],
+            color::MakeHueRotation<Tier>(-angle * 180.0f / fastmath::kPi), 1.0f, false,
+            despilled, spill, luma);
+        sum += despilled.y + luma;
+      }
+      Clock::time_point end = Clock::now();
+      sink = sink + sum;
+
+      typedef std::chrono::duration<double, std::nano> Nanoseconds;
+      double n = static_cast<double>(pixels.size());
+      best.pick = std::min(best.pick, Nanoseconds(middle - start).count() / n);
+      best.color = std::min(best.color, Nanoseconds(end - middle).count() / n);
+    }
+    return best;
+  }
+}  // namespace
+
+int main(int argc, char **argv)
+{
+  int samples = argc > 1 ? std::atoi(argv[1]) : 20000;
+  std::vector<std::string> failures;
+
+  for(const InputRange &range : kRanges) {
+    std::printf("%s\n", range.name);
+
+    for(int tier = TIER_EXACT; tier < TIER_COUNT; ++tier) {
+      TierStats stats;
+
+      switch(tier) {
+        case TIER_FAST:
+          MeasureTier<fastmath::FastTier>(range, samples, stats);
+          break;
+        case TIER_LUT:
+          MeasureTier<fastmath::LutTier>(range, samples, stats);
+          break;
+        default:
+          MeasureTier<fastmath::ExactTier>(range, samples, stats);
+          break;
+      }
+
+      // the Exact tier is reported against the reference only, the other tiers are
+      // held to the fixed budget of the range against it
+      bool pass = tier == TIER_EXACT || stats.pixelExact.maxScaled <= range.budget;
+      if(!pass) {
+        failures.push_back(std::string(range.name) + " " + kTierNames[tier]);
+      }
+
+      if(tier == TIER_EXACT) {
+        std::printf(" %s (reference scaled %.3e)\n", kTierNames[tier], stats.pixel.maxScaled);
+      }
+      else {
+        std::printf(" %s (budget %.3e, scaled %.3e against Exact) %s\n", kTierNames[tier],
+                    range.budget, stats.pixelExact.maxScaled, pass ? "ok" : "OVER BUDGET");
+      }
+      stats.hueRotate.Print("HueRotate");
+      stats.colorAngle.Print("ColorAngle");
+      stats.despill.Print("Despill");
+      stats.lumaRange.Print("LumaRange");
+      stats.pixel.Print("DespillPixel");
+      if(tier != TIER_EXACT) {
+        stats.pixelExact.Print("vs Exact");
+      }
+    }
+  }
+
+  // throughput of each tier on the same pixels, an approximation that is not faster
+  // than the standard library has no reason to be offered
+  Harness h;
+  std::vector<Vector3> pixels(kThroughputPixels), colors(kThroughputPixels);
+  for(int i = 0; i < kThroughputPixels; i++) {
+    pixels[i] = Vector3(h.Uniform(0.0f, 0.6f), h.Uniform(0.3f, 1.0f), h.Uniform(0.0f, 0.5f));
+    colors[i] = h.SpillColor(Constants::COLOR_GREEN);
+  }
+  color::PixelParams p = {};
+  p.clr = Constants::COLOR_RED;
+  p.despillMath = Constants::DESPILL_AVERAGE;
+  p.protectTones = true;
+  p.protectColor[0] = 0.9f;
+  p.protectColor[1] = 0.6f;
+  p.protectColor[2] = 0.4f;
+  p.protectExponent = color::ProtectExponent(0.2f, 2.0f);
+  p.protectEffect = 1.0f;
+  p.respillMath = Constants::LUMA_REC709;
+  p.whitePoint = 1.0f;
+
+  std::printf("throughput, ns per pixel\n");
+  Throughput exact = MeasureThroughput<fastmath::ExactTier>(pixels, colors, p);
+  for(int tier = TIER_EXACT; tier < TIER_COUNT; ++tier) {
+    Throughput t = exact;
+    if(tier == TIER_FAST) {
+      t = MeasureThroughput<fastmath::FastTier>(pixels, colors, p);
+    }
+    else if(tier == TIER_LUT) {
+      t = MeasureThroughput<fastmath::LutTier>(pixels, colors, p);
+    }
+
+    // timings of a debug build say nothing about the tiers
+    const char *verdict = "";
+#ifdef NDEBUG
+    if(tier != TIER_EXACT) {
+      verdict = t.pick < exact.pick && t.color < exact.color ? "faster" : "NOT FASTER";
+    }
+#endif
+    std::printf(" %-6s pick %6.2f (%.2fx)  color %6.2f (%.2fx) %s\n", kTierNames[tier], t.pick,
+                exact.pick / t.pick, t.color, exact.color / t.color, verdict);
+  }
+
+  for(const std::string &failure : failures) {
+    std::printf("OVER BUDGET: %s\n", failure.c_str());
+  }
+  return failures.empty() ? 0 : 1;
+}